@@ -1,6 +1,14 @@
 #pragma once
 
 #include "freertos/idf_additions.h"
+#include <stdint.h>
+
+#define OWL_BUTTON_QUEUE_LEN 4
+
+// Button input from GPIO edge interrupts. Edges are timestamped in the ISR,
+// debounced and classified by a state machine in the button task and
+// delivered without blocking; events that don't fit in the queue are
+// dropped.
 
 extern QueueHandle_t owl_button_event_queue;
 
@@ -10,4 +18,9 @@ typedef enum {
     OWL_BUTTON_LONG_PRESS,
 } owl_button_event_t;
 
+typedef struct {
+    owl_button_event_t event;
+    int64_t timestamp_us; // esp_timer time of the (first) press edge
+} owl_button_press_t;
+
 void owl_button_init(int32_t gpio_num);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/idf_additions.h"
+#include "owl_onewire.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Remote command protocol (WebSocket text frames, one command per frame):
+//
+//   <id> scan [count]        - run `count` scans (default 1)
+//   <id> monitor <period_ms> - scan continuously every `period_ms`
+//   <id> stop                - stop continuous monitoring
+//   <id> bus <index>         - select OneWire bus used by subsequent scans
+//   <id> calibrate           - calibrate and persist timing of selected bus
+//   <id> cancel <target>     - abort the scan in progress of command
+//                              `target` sent on the same WebSocket, along
+//                              with the remaining scans of a `scan <count>`
+//
+// `id` is a non-zero client-chosen request id, echoed as the first token of
+// every reply, so several commands can be pipelined without waiting:
+//
+//   <id> <ROM> [memory]      - one line per device found, followed by the
+//                              start of its memory (hex) for known families
+//   <id> ok                  - command completed
+//   <id> err <reason>        - command rejected or failed
+//
+// A scan that runs out of time (CONFIG_OWL_ONEWIRE_SCAN_TIMEOUT_MS), hits a
+// bus fault or is cancelled still reports the devices it found; the command
+// then completes with `err timeout`, `err bus` or `err cancelled`.
+//
+// Replies go to the WebSocket that sent the command only. Id 0 is reserved for
+// locally triggered (button) scans, reported to every connected WebSocket.
+//
+// A cancel is answered as soon as it arrives, since the scan it aborts holds
+// the command queue: `ok` once requested, `err not running` when `target` is
+// not the command in progress or came from another WebSocket. Cancelling a
+// monitor aborts its current scan only, `stop` ends it.
+
+#define OWL_COMMAND_QUEUE_LEN CONFIG_OWL_COMMAND_QUEUE_LEN
+
+typedef enum {
+    OWL_COMMAND_SCAN,
+    OWL_COMMAND_MONITOR_START,
+    OWL_COMMAND_MONITOR_STOP,
+    OWL_COMMAND_SELECT_BUS,
+    OWL_COMMAND_CALIBRATE,
+    OWL_COMMAND_CANCEL,
+} owl_command_type_t;
+
+typedef struct {
+    owl_command_type_t type;
+    uint32_t id;
+    int32_t arg; // scan count, monitor period (ms), bus index or cancel target
+    int fd;      // WebSocket the command came from, where replies go
+} owl_command_t;
+
+extern QueueHandle_t owl_command_queue;
+
+// Cancellation token of the command in progress, passed to its searches.
+// owl_task brackets every command (or local scan) it runs with
+// owl_command_begin() and owl_command_end(), starting a generation each time,
+// so a cancel only reaches the one in progress and never the commands queued
+// behind it.
+extern owl_onewire_cancel_t owl_command_cancel;
+
+void owl_command_init(void);
+
+void owl_command_begin(uint32_t id, int fd);
+void owl_command_end(void);
+
+// Requests cancellation of command `id` if it is in progress and was sent on
+// WebSocket `fd`, returns whether it was
+bool owl_command_cancel_running(uint32_t id, int fd);
+
+esp_err_t owl_command_parse(const char *s, owl_command_t *cmd);
@@ -2,4 +2,5 @@
 
 void owl_http_server_init();
 
-void owl_ws_send(const char *message);
+// Sends `message` to the WebSocket `fd`, or to every connected one if negative
+void owl_ws_send(int fd, const char *message);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "esp_err.h"
+#include "owl_metrics.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous transaction scheduler for the shared I2C bus
+// (CONFIG_OWL_I2C_SDA_GPIO / CONFIG_OWL_I2C_SCL_GPIO). Writes are copied into
+// a queue and return immediately; a low-priority worker drains everything
+// queued in one go, serving devices by priority (in order within a device),
+// so neither a slow nor a NAKing device can stall its callers. A device that
+// fails more than `error_budget` transfers in a row is suspended for
+// CONFIG_OWL_I2C_SUSPEND_MS: its queued and new writes are dropped until a
+// transfer succeeds again. Devices that lose their state meanwhile (e.g. power
+// cycled) can have an init sequence, replayed before their next write.
+
+#define OWL_I2C_MAX_DEVICES 4
+#define OWL_I2C_MAX_WRITE_LEN 24 // total of the transfers of a write
+#define OWL_I2C_MAX_TRANSFERS 2  // per write
+
+typedef struct owl_i2c_device owl_i2c_device_t;
+
+typedef struct {
+    const uint8_t *data;
+    uint8_t len;
+    uint32_t delay_us; // pause before the next transfer on the bus
+} owl_i2c_transfer_t;
+
+typedef struct {
+    uint16_t address; // 7-bit
+    uint32_t scl_speed_hz;
+    uint8_t priority;     // higher is served first
+    uint8_t max_pending;  // queued writes, keeps the queue free for others
+    uint8_t error_budget; // consecutive failures before suspension
+    owl_metric_t *errors; // optional counter of failed transfers
+    // Optional, run before the first write and before the first write after
+    // each suspension, which it probes the device with. Must stay valid.
+    const owl_i2c_transfer_t *init;
+    size_t init_count;
+} owl_i2c_device_config_t;
+
+// Creates the bus and starts the worker, further calls are ignored
+void owl_i2c_init(void);
+
+esp_err_t owl_i2c_add_device(const owl_i2c_device_config_t *config,
+                             owl_i2c_device_t **device);
+
+// Queues a write of `count` transfers, run back to back and queued as one:
+// either all of them are queued or none. A failed transfer skips the ones
+// after it. Never blocks: returns ESP_ERR_NO_MEM when the device has
+// `max_pending` writes queued, ESP_ERR_INVALID_STATE while it is suspended.
+esp_err_t owl_i2c_write_seq(owl_i2c_device_t *device,
+                            const owl_i2c_transfer_t *transfers,
+                            size_t count);
+
+// Queues a single transfer of `len` bytes, followed by a pause of `delay_us`
+// before the next transfer on the bus (for devices that must not be addressed
+// while busy)
+esp_err_t owl_i2c_write(owl_i2c_device_t *device,
+                        const uint8_t *data,
+                        size_t len,
+                        uint32_t delay_us);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Deferred logging for hot paths. With CONFIG_OWL_LOG_DEFERRED, OWL_LOG*
+// calls only copy the format string pointer, tag and raw arguments into a
+// RAM ring (strings are copied, truncated); formatting and console output
+// happen later in a low-priority task. The ring can also be fetched raw at
+// `/console.bin` and decoded on the host against the firmware ELF
+// (tools/owl_log_decode.py). Without it, OWL_LOG* are plain ESP_LOG*.
+
+#ifdef CONFIG_OWL_LOG_DEFERRED
+
+#define OWL_LOGE(tag, format, ...)                                             \
+    owl_log_write(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define OWL_LOGW(tag, format, ...)                                             \
+    owl_log_write(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define OWL_LOGI(tag, format, ...)                                             \
+    owl_log_write(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+
+// Binary dump layout (all little-endian): owl_log_dump_header_t, followed by
+// records, each an owl_log_record_t followed by its arguments. Integers and
+// pointers take 4 bytes, `ll`/`j` integers and doubles 8, strings a length
+// byte and that many characters.
+
+#define OWL_LOG_DUMP_MAGIC 0x4C4C574F // "OWLL"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t lost; // records overwritten before being formatted
+} owl_log_dump_header_t;
+
+typedef struct {
+    uint16_t len; // whole record, padded to 4 bytes
+    uint8_t level;
+    uint8_t padding; // bytes following the arguments
+    uint32_t timestamp_ms;
+    const char *tag;
+    const char *format;
+} owl_log_record_t;
+
+void owl_log_init(void);
+
+void owl_log_write(esp_log_level_t level,
+                   const char *tag,
+                   const char *format,
+                   ...) __attribute__((format(printf, 3, 4)));
+
+// Copies the dump header and the retained records into `buff`, returns the
+// number of bytes written
+size_t owl_log_dump(uint8_t *buff, size_t size);
+
+// Formats the records of a dump as text lines, calling `emit` for each. Only
+// valid for a dump of the running firmware, whose strings it points into.
+typedef void (*owl_log_emit_t)(const char *line, void *ctx);
+void owl_log_format_dump(const uint8_t *dump,
+                         size_t len,
+                         owl_log_emit_t emit,
+                         void *ctx);
+
+#else
+
+#define OWL_LOGE(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#define OWL_LOGW(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+#define OWL_LOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+
+static inline void owl_log_init(void)
+{
+}
+
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+
+// Per-subsystem heap accounting. Allocations made through owl_malloc are
+// tagged directly; memory allocated internally by drivers during init is
+// attributed by measuring the free heap around it (owl_mem_track_*).
+
+typedef enum {
+    OWL_MEM_HTTP,
+    OWL_MEM_WIFI,
+    OWL_MEM_ONEWIRE,
+    OWL_MEM_DISPLAY,
+    OWL_MEM_MQTT,
+    OWL_MEM_TAG_COUNT,
+} owl_mem_tag_t;
+
+typedef struct {
+    size_t current;
+    size_t peak;
+} owl_mem_stats_t;
+
+void *owl_malloc(owl_mem_tag_t tag, size_t size);
+void owl_free(owl_mem_tag_t tag, void *ptr);
+
+size_t owl_mem_track_begin(void);
+void owl_mem_track_end(owl_mem_tag_t tag, size_t begin);
+
+const char *owl_mem_tag_name(owl_mem_tag_t tag);
+void owl_mem_stats(owl_mem_tag_t tag, owl_mem_stats_t *stats);
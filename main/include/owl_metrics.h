@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Metrics registry, served in Prometheus text format at `/metrics`. Metrics
+// are defined statically by the module owning them and registered once at
+// init. Updates never block: counter and gauge updates are single relaxed
+// 32-bit atomic operations, safe from any task. Counters and histogram buckets
+// wrap at 2^32, which Prometheus treats as a counter reset.
+//
+// Histogram sums are 64-bit, so that they don't wrap long before their count
+// (e.g. sums of microseconds). The target has no lock-free 64-bit atomics, so
+// the sum is kept as two 32-bit halves: each histogram must be observed by a
+// single owner task, and scrapes retry until they read both halves unchanged.
+//
+//   OWL_METRIC_COUNTER_DEFINE(sends, "owl_ws_sends_total", "Messages sent");
+//   ...
+//   owl_metrics_register(&sends);
+//   ...
+//   owl_metric_inc(&sends);
+
+typedef enum {
+    OWL_METRIC_COUNTER,
+    OWL_METRIC_GAUGE,
+    OWL_METRIC_HISTOGRAM,
+} owl_metric_type_t;
+
+typedef struct owl_metric {
+    const char *name;
+    const char *help;
+    owl_metric_type_t type;
+    uint32_t value; // counter, gauge (as int32_t)
+    // Gauges only: sampled when scraped instead of being set
+    int32_t (*read)(void);
+    // Histograms only: `bucket_count` upper bounds, `bucket_count + 1` counts
+    // (the last one for values above every bound) and the sum of the values,
+    // consistent whenever `sum_seq` is even and unchanged around reading it
+    uint32_t sum_seq;
+    uint32_t sum_lo;
+    uint32_t sum_hi;
+    const uint32_t *bounds;
+    uint32_t *buckets;
+    size_t bucket_count;
+    bool registered;
+    struct owl_metric *next;
+} owl_metric_t;
+
+#define OWL_METRIC_COUNTER_DEFINE(var, metric_name, metric_help)               \
+    static owl_metric_t var = {                                                \
+        .name = (metric_name),                                                 \
+        .help = (metric_help),                                                 \
+        .type = OWL_METRIC_COUNTER,                                            \
+    }
+
+// `read_fn` may be NULL for gauges updated with owl_metric_set()
+#define OWL_METRIC_GAUGE_DEFINE(var, metric_name, metric_help, read_fn)        \
+    static owl_metric_t var = {                                                \
+        .name = (metric_name),                                                 \
+        .help = (metric_help),                                                 \
+        .type = OWL_METRIC_GAUGE,                                              \
+        .read = (read_fn),                                                     \
+    }
+
+// Bucket upper bounds follow the help string, in increasing order
+#define OWL_METRIC_HISTOGRAM_DEFINE(var, metric_name, metric_help, ...)        \
+    static const uint32_t var##_bounds[] = { __VA_ARGS__ };                    \
+    static uint32_t                                                            \
+        var##_buckets[sizeof(var##_bounds) / sizeof(var##_bounds[0]) + 1];     \
+    static owl_metric_t var = {                                                \
+        .name = (metric_name),                                                 \
+        .help = (metric_help),                                                 \
+        .type = OWL_METRIC_HISTOGRAM,                                          \
+        .bounds = var##_bounds,                                                \
+        .buckets = var##_buckets,                                              \
+        .bucket_count = sizeof(var##_bounds) / sizeof(var##_bounds[0]),        \
+    }
+
+// Adds `metric` to the registry, further calls are ignored
+void owl_metrics_register(owl_metric_t *metric);
+
+static inline void owl_metric_add(owl_metric_t *metric, uint32_t n)
+{
+    __atomic_fetch_add(&metric->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void owl_metric_inc(owl_metric_t *metric)
+{
+    owl_metric_add(metric, 1);
+}
+
+static inline void owl_metric_set(owl_metric_t *metric, int32_t value)
+{
+    __atomic_store_n(&metric->value, (uint32_t) value, __ATOMIC_RELAXED);
+}
+
+// Only ever called by the owner task of `metric`
+static inline void owl_metric_observe(owl_metric_t *metric, uint32_t value)
+{
+    size_t i = 0;
+    while (i < metric->bucket_count && value > metric->bounds[i]) {
+        i++;
+    }
+    __atomic_fetch_add(&metric->buckets[i], 1, __ATOMIC_RELAXED);
+
+    uint32_t seq = metric->sum_seq;
+    __atomic_store_n(&metric->sum_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint32_t lo = metric->sum_lo + value;
+    __atomic_store_n(
+        &metric->sum_hi, metric->sum_hi + (lo < value), __ATOMIC_RELAXED);
+    __atomic_store_n(&metric->sum_lo, lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&metric->sum_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Formats every registered metric in Prometheus text exposition format,
+// calling `emit` for each line
+typedef void (*owl_metrics_emit_t)(const char *line, void *ctx);
+void owl_metrics_format(owl_metrics_emit_t emit, void *ctx);
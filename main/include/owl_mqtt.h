@@ -0,0 +1,32 @@
+#pragma once
+
+#include "owl_scanlog.h"
+#include "sdkconfig.h"
+#include <stddef.h>
+
+// MQTT publishing of scan results. Records are buffered in RAM and published
+// in batches (one JSON message per CONFIG_OWL_MQTT_BATCH_RECORDS records or
+// CONFIG_OWL_MQTT_BATCH_WINDOW_MS). While the broker is unreachable the RAM
+// buffer fills up and further records are left in the scan log, from which
+// they are drained at a limited rate after reconnecting.
+
+#ifdef CONFIG_OWL_MQTT
+
+void owl_mqtt_init(void);
+
+// Never blocks, records that fit neither in RAM nor in the scan log are
+// dropped
+void owl_mqtt_publish(const owl_scanlog_record_t *records, size_t count);
+
+#else
+
+static inline void owl_mqtt_init(void)
+{
+}
+
+static inline void owl_mqtt_publish(const owl_scanlog_record_t *records,
+                                    size_t count)
+{
+}
+
+#endif
@@ -1,7 +1,73 @@
 #pragma once
 
+#include "esp_err.h"
 #include "onewire_types.h"
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define OWL_ONEWIRE_MAX_BUSES 2
+
+// Per-bus search timing. Slot timings themselves are fixed by the RMT backend,
+// these add recovery time on top of them for long or heavily loaded harnesses.
+typedef struct {
+    uint16_t reset_recovery_us; // settle time after reset, before ROM command
+    uint16_t slot_recovery_us;  // extra recovery time after every bit slot
+    uint8_t retries;            // extra attempts per search branch on errors
+} owl_onewire_timing_t;
 
 onewire_bus_handle_t owl_onewire_init(int bus_gpio_number);
-size_t owl_onewire_search(onewire_device_address_t buff[], size_t max_devices);
+esp_err_t owl_onewire_select_bus(size_t index);
+onewire_bus_handle_t owl_onewire_bus(void);
+
+// Cancellation token of a running search, requested from any task. Its owner
+// starts a new generation for every unit of work it may cancel (one or more
+// searches); a request cancels the generation current when it is made and
+// never a later one, so there is nothing to reset. The search checks it once
+// per byte.
+typedef struct {
+    volatile uint32_t generation; // written by the owner only
+    volatile uint32_t cancelled;  // last generation requested to stop
+} owl_onewire_cancel_t;
+
+static inline void owl_onewire_cancel_begin(owl_onewire_cancel_t *cancel)
+{
+    cancel->generation++;
+}
+
+static inline void owl_onewire_cancel_request(owl_onewire_cancel_t *cancel)
+{
+    cancel->cancelled = cancel->generation;
+}
+
+static inline bool owl_onewire_cancelled(const owl_onewire_cancel_t *cancel)
+{
+    return cancel->cancelled == cancel->generation;
+}
+
+// Searches the selected bus for at most `budget_us` (0 for no limit), stops
+// early when `cancel` (may be NULL) is requested. Devices found so far are
+// always stored in `buff` and counted in `count`, whatever the status:
+//   ESP_OK               - search complete (or `max_devices` reached)
+//   ESP_ERR_TIMEOUT      - budget exhausted
+//   ESP_ERR_NOT_FINISHED - cancelled
+//   other                - bus fault or CRC errors persisting after retries
+esp_err_t owl_onewire_search(onewire_device_address_t buff[],
+                             size_t max_devices,
+                             int64_t budget_us,
+                             const owl_onewire_cancel_t *cancel,
+                             size_t *count);
+
+// Reads up to `max_len` bytes of device memory using the driver for the
+// device's family code, validating CRC16 as the data streams in. Returns
+// ESP_ERR_NOT_SUPPORTED for families without a driver.
+esp_err_t owl_onewire_read_memory(onewire_device_address_t rom,
+                                  uint8_t *buff,
+                                  size_t max_len,
+                                  size_t *len);
+
+// Sweeps timings on the selected bus from the most conservative to the
+// fastest, keeps the fastest one that gives consistent results and persists
+// it in NVS
+esp_err_t owl_onewire_calibrate(void);
+void owl_onewire_get_timing(owl_onewire_timing_t *timing);
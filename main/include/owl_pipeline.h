@@ -0,0 +1,46 @@
+#pragma once
+
+#include "owl_scan.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Scan pipeline. owl_task acquires scan records (search, memory reads) and
+// hands them over to the scan log and MQTT, which keep every record; formatting
+// and fan-out to the display and the WebSocket run on separate lower-priority
+// tasks. Those stages are joined by bounded single-producer queues whose
+// overflow policy is configurable, so a slow consumer never holds up
+// acquisition unless told to. The policy only applies to scan records, status
+// replies are never dropped.
+//
+//   owl_task -> scan log, MQTT
+//            -> [format queue] -> format, display
+//            -> [ws queue] -> WebSocket
+
+typedef enum {
+    OWL_OVERFLOW_DROP_NEWEST, // reject the item being pushed
+    OWL_OVERFLOW_DROP_OLDEST, // evict the oldest queued item
+    OWL_OVERFLOW_BLOCK,       // wait for the consumer
+} owl_overflow_t;
+
+typedef struct {
+    const char *name;
+    owl_overflow_t policy;
+    uint32_t pushed;
+    uint32_t dropped;
+    size_t waiting;
+} owl_pipeline_queue_stats_t;
+
+void owl_pipeline_init(void);
+
+// Logs and publishes `record`, then hands it over to the pipeline, which frees
+// it once delivered
+void owl_pipeline_submit(owl_scan_record_t *record);
+
+// Sends "<id> <status>" to the WebSocket `fd` once all previously submitted
+// records are delivered, waiting for room in a full queue rather than dropping
+// it. `status` must be a string literal.
+void owl_pipeline_reply(uint32_t id, int fd, const char *status);
+
+// Stats of the i-th stage queue, false past the last one
+bool owl_pipeline_queue_stats(size_t i, owl_pipeline_queue_stats_t *stats);
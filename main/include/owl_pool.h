@@ -0,0 +1,44 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-block memory pool backed by static storage. Allocation and release
+// are O(1) and never touch the heap, so long-lived traffic (network frames,
+// scan records) can't fragment it.
+
+typedef struct owl_pool {
+    const char *name;
+    portMUX_TYPE lock;
+    uint8_t *storage;
+    size_t block_size;
+    size_t block_count;
+    void *free_list;
+    size_t used;
+    size_t peak;
+    uint32_t failures;
+    struct owl_pool *next;
+} owl_pool_t;
+
+#define OWL_POOL_BLOCK_SIZE(size) (((size) + 7) & ~(size_t) 7)
+
+// Defines a file-local pool `var` of `count` blocks of `size` bytes
+#define OWL_POOL_DEFINE(var, pool_name, size, count)                           \
+    static uint8_t var##_storage[(count) * OWL_POOL_BLOCK_SIZE(size)]          \
+        __attribute__((aligned(8)));                                           \
+    static owl_pool_t var = {                                                  \
+        .name = (pool_name),                                                   \
+        .lock = portMUX_INITIALIZER_UNLOCKED,                                  \
+        .storage = var##_storage,                                              \
+        .block_size = OWL_POOL_BLOCK_SIZE(size),                               \
+        .block_count = (count),                                                \
+    }
+
+void owl_pool_init(owl_pool_t *pool);
+
+void *owl_pool_alloc(owl_pool_t *pool);
+void owl_pool_free(owl_pool_t *pool, void *block);
+
+// Iterates over all initialized pools, starting with NULL
+const owl_pool_t *owl_pool_next(const owl_pool_t *pool);
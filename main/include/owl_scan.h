@@ -0,0 +1,41 @@
+#pragma once
+
+#include "onewire_types.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#define OWL_SCAN_MAX_DEVICES 1
+
+#ifdef CONFIG_OWL_ONEWIRE_READ_MEMORY
+#define OWL_SCAN_MEMORY_LEN CONFIG_OWL_ONEWIRE_MEMORY_LEN
+#else
+#define OWL_SCAN_MEMORY_LEN 0
+#endif
+
+// "<id> " prefix, 16 char address, " <memory hex>" and a newline per device,
+// null terminator
+#define OWL_SCAN_TEXT_LEN                                                      \
+    (OWL_SCAN_MAX_DEVICES * (11 + 16 + 1 + 2 * OWL_SCAN_MEMORY_LEN + 1) + 1)
+
+typedef struct {
+    int64_t timestamp_us;
+    uint32_t id; // command id, 0 for local scans
+    int fd;      // WebSocket to report to, -1 for every connected one
+    uint32_t count;
+    onewire_device_address_t addresses[OWL_SCAN_MAX_DEVICES];
+#ifdef CONFIG_OWL_ONEWIRE_READ_MEMORY
+    uint16_t memory_len[OWL_SCAN_MAX_DEVICES]; // 0 if not read
+    uint8_t memory[OWL_SCAN_MAX_DEVICES][OWL_SCAN_MEMORY_LEN];
+#endif
+#ifdef CONFIG_OWL_TRACE
+    int64_t origin_us; // trace origin (button press / command)
+#endif
+    char text[OWL_SCAN_TEXT_LEN]; // WebSocket message, set when formatted
+} owl_scan_record_t;
+
+void owl_scan_init(void);
+
+// Scan records come from a fixed pool (CONFIG_OWL_POOL_RECORD_COUNT), NULL is
+// returned when it is exhausted
+owl_scan_record_t *owl_scan_record_alloc(void);
+void owl_scan_record_free(owl_scan_record_t *record);
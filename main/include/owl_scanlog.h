@@ -0,0 +1,38 @@
+#pragma once
+
+#include "esp_err.h"
+#include "owl_scan.h"
+#include <stdint.h>
+
+// Append-only log of scan results in the raw `scanlog` flash partition.
+//
+// Fixed-size records are appended by a background writer in page-sized
+// batches, the partition is used as a ring of sectors (evening out wear) and
+// the oldest sectors are erased ahead of the writer once the log exceeds its
+// retention limit. A power cut loses at most the batch not yet flushed.
+
+#define OWL_SCANLOG_SEQ_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t seq;
+    uint32_t id;          // command id, 0 for local scans
+    int64_t timestamp_us; // time of day
+    uint64_t rom;
+    uint32_t reserved;
+    uint32_t crc; // CRC32 of the preceding fields
+} owl_scanlog_record_t;
+
+esp_err_t owl_scanlog_init(void);
+
+// Queues one record per device found, never blocks. Records that don't fit in
+// the writer queue are dropped. If `records` isn't NULL the records are also
+// stored there (`scan->count` entries), with seq OWL_SCANLOG_SEQ_NONE for
+// those that weren't logged.
+void owl_scanlog_append(const owl_scan_record_t *scan,
+                        owl_scanlog_record_t *records);
+
+// Sequence numbers of the oldest retained and of the record following the last
+// one written to flash
+void owl_scanlog_range(uint32_t *first_seq, uint32_t *next_seq);
+
+esp_err_t owl_scanlog_read(uint32_t seq, owl_scanlog_record_t *record);
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+// Task, queue and semaphore creation that follows the allocation mode. With
+// CONFIG_OWL_STATIC_ALLOC, the storage of every object is reserved at file
+// scope by its OWL_*_DEFINE, so the whole footprint shows up in the link map
+// (see tools/owl_ram_report.py) and nothing is allocated at runtime.
+// Otherwise the DEFINE only records the sizes and objects come from the heap.
+//
+//   OWL_QUEUE_DEFINE(led_queue, 4, sizeof(int));
+//   ...
+//   owl_led_command_queue = OWL_QUEUE_CREATE(led_queue);
+
+#ifdef CONFIG_OWL_STATIC_ALLOC
+
+// Storage for `count` instances of a task with a `stack_size` bytes stack
+#define OWL_TASK_DEFINE(var, stack_size, count)                                \
+    static StackType_t var##_stack[(count)][(stack_size)];                     \
+    static StaticTask_t var##_tcb[(count)]
+
+// Creates the i-th instance, returns its handle or NULL
+#define OWL_TASK_CREATE(var, i, task, name, arg, priority, core)               \
+    xTaskCreateStaticPinnedToCore((task),                                      \
+                                  (name),                                      \
+                                  sizeof(var##_stack[0]),                      \
+                                  (arg),                                       \
+                                  (priority),                                  \
+                                  var##_stack[(i)],                            \
+                                  &var##_tcb[(i)],                             \
+                                  (core))
+
+#define OWL_QUEUE_DEFINE(var, len, item_size)                                  \
+    enum { var##_len = (len), var##_item_size = (item_size) };                 \
+    static uint8_t var##_storage[(len) * (item_size)];                         \
+    static StaticQueue_t var##_queue
+
+#define OWL_QUEUE_CREATE(var)                                                  \
+    xQueueCreateStatic(var##_len, var##_item_size, var##_storage, &var##_queue)
+
+// A queue set holds the handles of its members' events (as in FreeRTOS 11
+// xQueueCreateSetStatic)
+#define OWL_QUEUE_SET_DEFINE(var, len)                                         \
+    OWL_QUEUE_DEFINE(var, len, sizeof(QueueSetMemberHandle_t))
+
+#define OWL_QUEUE_SET_CREATE(var)                                              \
+    xQueueGenericCreateStatic(var##_len,                                       \
+                              var##_item_size,                                 \
+                              var##_storage,                                   \
+                              &var##_queue,                                    \
+                              queueQUEUE_TYPE_SET)
+
+#define OWL_MUTEX_DEFINE(var) static StaticSemaphore_t var##_semaphore
+
+#define OWL_MUTEX_CREATE(var) xSemaphoreCreateMutexStatic(&var##_semaphore)
+
+#define OWL_SEMAPHORE_DEFINE(var, max, initial)                                \
+    enum { var##_max = (max), var##_initial = (initial) };                     \
+    static StaticSemaphore_t var##_semaphore
+
+#define OWL_SEMAPHORE_CREATE(var)                                              \
+    xSemaphoreCreateCountingStatic(                                            \
+        var##_max, var##_initial, &var##_semaphore)
+
+#else
+
+#define OWL_TASK_DEFINE(var, stack_size, count)                                \
+    enum { var##_stack_size = (stack_size) }
+
+#define OWL_TASK_CREATE(var, i, task, name, arg, priority, core)               \
+    owl_task_create((task), (name), var##_stack_size, (arg), (priority), (core))
+
+#define OWL_QUEUE_DEFINE(var, len, item_size)                                  \
+    enum { var##_len = (len), var##_item_size = (item_size) }
+
+#define OWL_QUEUE_CREATE(var) xQueueCreate(var##_len, var##_item_size)
+
+#define OWL_QUEUE_SET_DEFINE(var, len) enum { var##_len = (len) }
+
+#define OWL_QUEUE_SET_CREATE(var) xQueueCreateSet(var##_len)
+
+#define OWL_MUTEX_DEFINE(var) enum { var##_mutex }
+
+#define OWL_MUTEX_CREATE(var) xSemaphoreCreateMutex()
+
+#define OWL_SEMAPHORE_DEFINE(var, max, initial)                                \
+    enum { var##_max = (max), var##_initial = (initial) }
+
+#define OWL_SEMAPHORE_CREATE(var)                                              \
+    xSemaphoreCreateCounting(var##_max, var##_initial)
+
+static inline TaskHandle_t owl_task_create(TaskFunction_t task,
+                                           const char *name,
+                                           uint32_t stack_size,
+                                           void *arg,
+                                           UBaseType_t priority,
+                                           BaseType_t core)
+{
+    TaskHandle_t handle = NULL;
+    xTaskCreatePinnedToCore(
+        task, name, stack_size, arg, priority, &handle, core);
+    return handle;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lightweight latency tracing of the scan path. Spans are stamped with
+// esp_timer and written into a per-core ring, and aggregated into per-stage
+// log2 histograms as they are recorded. With CONFIG_OWL_TRACE disabled all
+// OWL_TRACE_* macros compile to nothing.
+
+typedef enum {
+    OWL_TRACE_INPUT,   // button press / command -> picked up by owl_task
+    OWL_TRACE_LED,     // LED on/off commands
+    OWL_TRACE_SEARCH,  // 1-Wire search
+    OWL_TRACE_MEMORY,  // device memory reads
+    OWL_TRACE_FORMAT,  // result formatting
+    OWL_TRACE_DISPLAY, // display requests
+    OWL_TRACE_WS_SEND, // WebSocket delivery
+    OWL_TRACE_TOTAL,   // press / command -> WebSocket delivery
+    OWL_TRACE_STAGE_COUNT,
+} owl_trace_stage_t;
+
+// Bucket i counts spans with duration in [2^(i-1), 2^i) us
+#define OWL_TRACE_BUCKETS 24
+
+typedef struct {
+    int64_t start_us;
+    uint32_t duration_us;
+    uint16_t trace_id;
+    uint8_t stage;
+    uint8_t core;
+} owl_trace_span_t;
+
+#ifdef CONFIG_OWL_TRACE
+
+#include "esp_timer.h"
+
+// Starts a new trace, subsequent spans are tagged with its id
+#define OWL_TRACE_BEGIN() owl_trace_begin()
+// Stamps the origin of the next trace (e.g. from a button callback)
+#define OWL_TRACE_ORIGIN() owl_trace_set_origin(esp_timer_get_time())
+// Same, with an earlier esp_timer timestamp (e.g. of a button edge)
+#define OWL_TRACE_ORIGIN_AT(time_us) owl_trace_set_origin(time_us)
+#define OWL_TRACE_TIMESTAMP(var) int64_t var = esp_timer_get_time()
+#define OWL_TRACE_SPAN(stage, start_us)                                        \
+    owl_trace_record((stage), (start_us), esp_timer_get_time())
+
+void owl_trace_init(void);
+
+void owl_trace_begin(void);
+void owl_trace_set_origin(int64_t origin_us);
+int64_t owl_trace_origin(void);
+void owl_trace_record(owl_trace_stage_t stage, int64_t start_us, int64_t end_us);
+
+const char *owl_trace_stage_name(owl_trace_stage_t stage);
+size_t owl_trace_snapshot(owl_trace_span_t *buff, size_t max_spans);
+void owl_trace_histogram(owl_trace_stage_t stage,
+                         uint32_t buckets[OWL_TRACE_BUCKETS]);
+
+#else
+
+#define OWL_TRACE_BEGIN()
+#define OWL_TRACE_ORIGIN()
+#define OWL_TRACE_ORIGIN_AT(time_us)
+#define OWL_TRACE_TIMESTAMP(var)
+#define OWL_TRACE_SPAN(stage, start_us)
+
+static inline void owl_trace_init(void)
+{
+}
+
+#endif
@@ -3,88 +3,277 @@
 #include <string.h>
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "freertos/projdefs.h"
 #include "owl_button.h"
+#include "owl_command.h"
 #include "owl_display.h"
 #include "owl_http_server.h"
 #include "owl_lcd.h"
 #include "owl_led.h"
+#include "owl_log.h"
+#include "owl_mqtt.h"
 #include "owl_onewire.h"
+#include "owl_pipeline.h"
+#include "owl_scan.h"
+#include "owl_scanlog.h"
+#include "owl_static.h"
+#include "owl_trace.h"
 #include "owl_wifi.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "portmacro.h"
 
 #define BUTTON_GPIO CONFIG_OWL_BUTTON_GPIO
 #define ONEWIRE_BUS_GPIO CONFIG_OWL_ONEWIRE_BUS_GPIO
+#define ONEWIRE_BUS2_GPIO CONFIG_OWL_ONEWIRE_BUS2_GPIO
 
-#define MAX_ONEWIRE_DEVICES 1
+#define SCAN_TIMEOUT_US (CONFIG_OWL_ONEWIRE_SCAN_TIMEOUT_MS * 1000LL)
+
+// Acquisition runs above every other pipeline stage
+#define OWL_TASK_PRIORITY 8
+#define OWL_TASK_STACK_SIZE 4096
 
 static const char *TAG = "owl";
 
-static void owl_task(void *arg)
+OWL_TASK_DEFINE(main_task, OWL_TASK_STACK_SIZE, 1);
+OWL_QUEUE_SET_DEFINE(event_set, OWL_BUTTON_QUEUE_LEN + OWL_COMMAND_QUEUE_LEN);
+
+// Acquisition stage of the scan pipeline: scans the selected bus and hands
+// the result over to be formatted and reported. Results of remote commands
+// are prefixed with the command id and go to the WebSocket `fd` that sent it,
+// local (button) scans use id 0 and are reported unprefixed to every client.
+// A scan is bounded by SCAN_TIMEOUT_US and can be cancelled remotely; devices
+// found before it stopped are still reported.
+static esp_err_t owl_scan(uint32_t id, int fd)
 {
-    owl_button_event_t e;
-    onewire_device_address_t address_buff[MAX_ONEWIRE_DEVICES];
-    // 16 char address, newline, null terminator
-    char response_buff[MAX_ONEWIRE_DEVICES * 17 + 1];
+    owl_scan_record_t *record = owl_scan_record_alloc();
+    if (!record) {
+        ESP_LOGE(TAG, "No free scan record");
+        return ESP_ERR_NO_MEM;
+    }
+    record->id = id;
+    record->fd = fd;
+    record->timestamp_us = esp_timer_get_time();
+
+    OWL_TRACE_BEGIN();
+    OWL_TRACE_SPAN(OWL_TRACE_INPUT, owl_trace_origin());
+#ifdef CONFIG_OWL_TRACE
+    record->origin_us = owl_trace_origin();
+#endif
+
+    OWL_TRACE_TIMESTAMP(led_on_start);
+    owl_led_on();
+    OWL_TRACE_SPAN(OWL_TRACE_LED, led_on_start);
+
+    OWL_TRACE_TIMESTAMP(search_start);
     size_t count;
+    esp_err_t ret = owl_onewire_search(record->addresses,
+                                       OWL_SCAN_MAX_DEVICES,
+                                       SCAN_TIMEOUT_US,
+                                       &owl_command_cancel,
+                                       &count);
+    record->count = count;
+    OWL_TRACE_SPAN(OWL_TRACE_SEARCH, search_start);
+
+#ifdef CONFIG_OWL_ONEWIRE_READ_MEMORY
+    OWL_TRACE_TIMESTAMP(memory_start);
+    for (size_t i = 0; i < record->count; i++) {
+        size_t len = 0;
+        // Memory reads share the budget of the search, devices past it are
+        // reported without memory
+        if (ret == ESP_OK && SCAN_TIMEOUT_US
+            && esp_timer_get_time() - record->timestamp_us >= SCAN_TIMEOUT_US) {
+            ret = ESP_ERR_TIMEOUT;
+        }
+        if (ret == ESP_OK && owl_onewire_cancelled(&owl_command_cancel)) {
+            ret = ESP_ERR_NOT_FINISHED;
+        }
+        if (ret == ESP_OK) {
+            owl_onewire_read_memory(record->addresses[i],
+                                    record->memory[i],
+                                    OWL_SCAN_MEMORY_LEN,
+                                    &len);
+        }
+        record->memory_len[i] = len;
+    }
+    OWL_TRACE_SPAN(OWL_TRACE_MEMORY, memory_start);
+#endif
+
+    OWL_TRACE_TIMESTAMP(led_off_start);
+    owl_led_off();
+    OWL_TRACE_SPAN(OWL_TRACE_LED, led_off_start);
+
+    owl_pipeline_submit(record);
+    return ret;
+}
+
+// Reply status of a scan command, a string literal
+static const char *owl_scan_status(esp_err_t ret)
+{
+    switch (ret) {
+    case ESP_OK:
+        return "ok";
+    case ESP_ERR_TIMEOUT:
+        return "err timeout";
+    case ESP_ERR_NOT_FINISHED:
+        return "err cancelled";
+    case ESP_ERR_NO_MEM:
+        return "err busy";
+    default:
+        return "err bus";
+    }
+}
+
+static void owl_handle_button(const owl_button_press_t *press)
+{
+    switch (press->event) {
+    case OWL_BUTTON_SINGLE_CLICK:
+        OWL_TRACE_ORIGIN_AT(press->timestamp_us);
+        owl_scan(0, -1);
+        break;
+    case OWL_BUTTON_DOUBLE_CLICK:
+        owl_led_blink(10);
+        vTaskDelay(pdMS_TO_TICKS(50));
+        owl_wifi_sta();
+        owl_led_blink_off();
+        break;
+    case OWL_BUTTON_LONG_PRESS:
+        owl_apsta();
+        owl_led_blink(500);
+        break;
+    default:
+        ESP_LOGW(TAG, "Unexpected button event");
+    }
+}
+
+static void owl_task(void *arg)
+{
+    owl_button_press_t press;
+    owl_command_t cmd;
+
+    QueueSetHandle_t events = OWL_QUEUE_SET_CREATE(event_set);
+    xQueueAddToSet(owl_button_event_queue, events);
+    xQueueAddToSet(owl_command_queue, events);
+
+    // Continuous monitoring state
+    uint32_t monitor_id = 0;
+    int monitor_fd = -1;
+    TickType_t monitor_period = portMAX_DELAY;
+    TickType_t next_monitor_scan = 0;
 
     while (1) {
-        char *response_ptr = response_buff;
-        if (xQueueReceive(owl_button_event_queue, &e, portMAX_DELAY)) {
-            switch (e) {
-            case OWL_BUTTON_SINGLE_CLICK:
-                owl_led_on();
-                count = owl_onewire_search(address_buff, MAX_ONEWIRE_DEVICES);
-                owl_led_off();
-
-                for (size_t i = 0; i < count; i++) {
-                    ESP_LOGI(
-                        TAG, "Found device #%zu: %" PRIX64, i, address_buff[i]);
-                    response_ptr += sprintf(
-                        response_ptr, "%" PRIX64 "\n", address_buff[i]);
-
-                    char disp_buff[17];
-                    snprintf(disp_buff, 17, "%" PRIX64, address_buff[i]);
-                    owl_display(
-                        "OneWire:", disp_buff, owl_rgb(OWL_COLOR_WHITE), 5000);
-                }
+        TickType_t timeout = portMAX_DELAY;
+        if (monitor_id != 0) {
+            TickType_t now = xTaskGetTickCount();
+            timeout = (int32_t) (next_monitor_scan - now) > 0
+                        ? next_monitor_scan - now
+                        : 0;
+        }
 
-                *response_ptr = '\0';
-                owl_ws_send(response_buff);
+        QueueSetMemberHandle_t member = xQueueSelectFromSet(events, timeout);
+        if (member == NULL) {
+            next_monitor_scan = xTaskGetTickCount() + monitor_period;
+            OWL_TRACE_ORIGIN();
+            owl_command_begin(monitor_id, monitor_fd);
+            owl_scan(monitor_id, monitor_fd);
+        } else if (member == owl_button_event_queue) {
+            xQueueReceive(owl_button_event_queue, &press, 0);
+            owl_command_begin(0, -1);
+            owl_handle_button(&press);
+        } else if (member == owl_command_queue) {
+            xQueueReceive(owl_command_queue, &cmd, 0);
+            owl_command_begin(cmd.id, cmd.fd);
+            switch (cmd.type) {
+            case OWL_COMMAND_SCAN: {
+                // Failed scans do not stop the remaining ones, the first
+                // failure is the status of the command
+                esp_err_t status = ESP_OK;
+                for (int32_t i = 0; i < cmd.arg; i++) {
+                    OWL_TRACE_ORIGIN();
+                    esp_err_t ret = owl_scan(cmd.id, cmd.fd);
+                    if (status == ESP_OK) {
+                        status = ret;
+                    }
+                    if (ret == ESP_ERR_NOT_FINISHED) {
+                        status = ret;
+                        break;
+                    }
+                }
+                owl_pipeline_reply(cmd.id, cmd.fd, owl_scan_status(status));
                 break;
-            case OWL_BUTTON_DOUBLE_CLICK:
-                owl_led_blink(10);
-                vTaskDelay(pdMS_TO_TICKS(50));
-                owl_wifi_sta();
-                owl_led_blink_off();
+            }
+            case OWL_COMMAND_MONITOR_START:
+                monitor_id = cmd.id;
+                monitor_fd = cmd.fd;
+                monitor_period = pdMS_TO_TICKS(cmd.arg);
+                if (monitor_period == 0) {
+                    monitor_period = 1;
+                }
+                next_monitor_scan = xTaskGetTickCount();
+                owl_pipeline_reply(cmd.id, cmd.fd, "ok");
+                break;
+            case OWL_COMMAND_MONITOR_STOP:
+                monitor_id = 0;
+                owl_pipeline_reply(cmd.id, cmd.fd, "ok");
                 break;
-            case OWL_BUTTON_LONG_PRESS:
-                owl_apsta();
-                owl_led_blink(500);
+            case OWL_COMMAND_SELECT_BUS:
+                owl_pipeline_reply(cmd.id,
+                                   cmd.fd,
+                                   owl_onewire_select_bus(cmd.arg) == ESP_OK
+                                       ? "ok"
+                                       : "err no such bus");
                 break;
+            case OWL_COMMAND_CALIBRATE: {
+                owl_led_blink(100);
+                esp_err_t ret = owl_onewire_calibrate();
+                owl_led_blink_off();
+                owl_pipeline_reply(cmd.id,
+                                   cmd.fd,
+                                   ret == ESP_OK ? "ok"
+                                                 : "err calibration failed");
+                break;
+            }
             default:
-                ESP_LOGW(TAG, "Unexpected button event");
+                owl_pipeline_reply(cmd.id, cmd.fd, "err unknown");
             }
         }
+        owl_command_end();
     }
 }
 
 void app_main(void)
 {
     ESP_LOGI(TAG, "Helou");
+    owl_log_init();
+    owl_trace_init();
+    owl_scan_init();
+    owl_pipeline_init();
     owl_led_init();
     owl_display_init();
+    owl_wifi_init(); // initializes NVS, used for 1-Wire calibration data
+
     owl_onewire_init(ONEWIRE_BUS_GPIO);
+    if (ONEWIRE_BUS2_GPIO >= 0) {
+        owl_onewire_init(ONEWIRE_BUS2_GPIO);
+    }
+    owl_scanlog_init();
     owl_button_init(BUTTON_GPIO);
+    owl_command_init();
 
-    owl_wifi_init();
     owl_wifi_configure();
     owl_wifi_sta();
     owl_http_server_init();
+    owl_mqtt_init();
 
-    xTaskCreate(owl_task, "owl_task", 4096, NULL, 5, NULL);
+    OWL_TASK_CREATE(main_task,
+                    0,
+                    owl_task,
+                    "owl_task",
+                    NULL,
+                    OWL_TASK_PRIORITY,
+                    CONFIG_OWL_PIPELINE_CORE);
 }
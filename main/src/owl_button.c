@@ -1,52 +1,209 @@
 #include "owl_button.h"
+#include "owl_static.h"
 
 #include <inttypes.h>
 
-#include "button_gpio.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
 #include "esp_log.h"
-#include "iot_button.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 
 static const char *TAG = "owl_button";
 
+#define DEBOUNCE_US (CONFIG_OWL_BUTTON_DEBOUNCE_MS * 1000LL)
+#define DOUBLE_CLICK_US (CONFIG_OWL_BUTTON_DOUBLE_CLICK_MS * 1000LL)
+#define LONG_PRESS_US (CONFIG_OWL_BUTTON_LONG_PRESS_MS * 1000LL)
+
+#define ACTIVE_LEVEL 0
+#define EDGE_QUEUE_LEN 16
+#define TASK_STACK_SIZE 3072
+// Above owl_task, so that edges are classified as soon as they arrive
+#define TASK_PRIORITY 9
+
+#define NO_DEADLINE INT64_MAX
+
 QueueHandle_t owl_button_event_queue;
 
-static void button_single_click_cb(void *arg, void *usr_data)
+typedef struct {
+    int64_t timestamp_us;
+    bool pressed;
+} button_edge_t;
+
+typedef enum {
+    STATE_IDLE,
+    STATE_PRESSED,     // first press, not yet classified
+    STATE_WAIT_SECOND, // released, waiting for a double click
+    STATE_HELD,        // classified, waiting for the release
+} button_state_t;
+
+OWL_QUEUE_DEFINE(event_queue, OWL_BUTTON_QUEUE_LEN, sizeof(owl_button_press_t));
+OWL_QUEUE_DEFINE(edge_queue, EDGE_QUEUE_LEN, sizeof(button_edge_t));
+OWL_TASK_DEFINE(button_task, TASK_STACK_SIZE, 1);
+
+static QueueHandle_t s_edge_queue;
+static gpio_num_t s_gpio;
+static volatile uint32_t s_edges_dropped = 0;
+static uint32_t s_events_dropped = 0;
+
+static void IRAM_ATTR button_isr(void *arg)
+{
+    button_edge_t edge = {
+        .timestamp_us = esp_timer_get_time(),
+        .pressed = gpio_get_level(s_gpio) == ACTIVE_LEVEL,
+    };
+
+    BaseType_t woken = pdFALSE;
+    if (xQueueSendFromISR(s_edge_queue, &edge, &woken) != pdTRUE) {
+        s_edges_dropped++;
+    }
+    portYIELD_FROM_ISR(woken);
+}
+
+static void emit(owl_button_event_t event, int64_t timestamp_us)
 {
-    owl_button_event_t e = OWL_BUTTON_SINGLE_CLICK;
-    xQueueSend(owl_button_event_queue, &e, portMAX_DELAY);
+    owl_button_press_t press = {
+        .event = event,
+        .timestamp_us = timestamp_us,
+    };
+    if (xQueueSend(owl_button_event_queue, &press, 0) != pdTRUE) {
+        s_events_dropped++;
+        ESP_LOGW(TAG, "Event queue full (%" PRIu32 " dropped)", s_events_dropped);
+    }
 }
 
-static void button_double_click_cb(void *arg, void *usr_data)
+static TickType_t ticks_until(int64_t deadline_us)
 {
-    owl_button_event_t e = OWL_BUTTON_DOUBLE_CLICK;
-    xQueueSend(owl_button_event_queue, &e, portMAX_DELAY);
+    if (deadline_us == NO_DEADLINE) {
+        return portMAX_DELAY;
+    }
+    int64_t remaining_us = deadline_us - esp_timer_get_time();
+    if (remaining_us <= 0) {
+        return 0;
+    }
+    // Round up, so that deadlines are never reported early
+    const int64_t tick_us = portTICK_PERIOD_MS * 1000LL;
+    return (remaining_us + tick_us - 1) / tick_us;
 }
 
-static void button_long_press_cb(void *arg, void *usr_data)
+static int64_t min_deadline(int64_t a, int64_t b)
 {
-    owl_button_event_t e = OWL_BUTTON_LONG_PRESS;
-    xQueueSend(owl_button_event_queue, &e, portMAX_DELAY);
+    return a < b ? a : b;
+}
+
+// Debounces edges (the first edge wins, bounces within the debounce period
+// are ignored and the level is re-sampled once it expires) and classifies
+// presses into clicks, double clicks and long presses
+static void owl_button_task(void *arg)
+{
+    button_state_t state = STATE_IDLE;
+    bool pressed = false;
+    int64_t last_edge_us = -DEBOUNCE_US;
+    int64_t press_us = 0;
+    int64_t state_deadline_us = NO_DEADLINE;
+    int64_t resample_deadline_us = NO_DEADLINE;
+    button_edge_t edge;
+
+    while (1) {
+        TickType_t timeout
+            = ticks_until(min_deadline(state_deadline_us, resample_deadline_us));
+        bool edge_received = xQueueReceive(s_edge_queue, &edge, timeout);
+        int64_t now = esp_timer_get_time();
+
+        if (!edge_received && now >= resample_deadline_us) {
+            // Bounces may have hidden the final level
+            resample_deadline_us = NO_DEADLINE;
+            edge.timestamp_us = now;
+            edge.pressed = gpio_get_level(s_gpio) == ACTIVE_LEVEL;
+            edge_received = true;
+        }
+
+        if (edge_received) {
+            if (edge.pressed == pressed) {
+                continue;
+            }
+            if (edge.timestamp_us - last_edge_us < DEBOUNCE_US) {
+                resample_deadline_us = last_edge_us + DEBOUNCE_US;
+                continue;
+            }
+            pressed = edge.pressed;
+            last_edge_us = edge.timestamp_us;
+
+            if (pressed && state == STATE_IDLE) {
+                press_us = edge.timestamp_us;
+                if (DOUBLE_CLICK_US == 0 && LONG_PRESS_US == 0) {
+                    // Nothing to wait for, fire on the press edge
+                    emit(OWL_BUTTON_SINGLE_CLICK, press_us);
+                    state = STATE_HELD;
+                } else {
+                    state = STATE_PRESSED;
+                    state_deadline_us
+                        = LONG_PRESS_US ? press_us + LONG_PRESS_US : NO_DEADLINE;
+                }
+            } else if (pressed && state == STATE_WAIT_SECOND) {
+                emit(OWL_BUTTON_DOUBLE_CLICK, press_us);
+                state = STATE_HELD;
+                state_deadline_us = NO_DEADLINE;
+            } else if (!pressed && state == STATE_PRESSED) {
+                if (DOUBLE_CLICK_US) {
+                    state = STATE_WAIT_SECOND;
+                    state_deadline_us = edge.timestamp_us + DOUBLE_CLICK_US;
+                } else {
+                    emit(OWL_BUTTON_SINGLE_CLICK, press_us);
+                    state = STATE_IDLE;
+                    state_deadline_us = NO_DEADLINE;
+                }
+            } else if (!pressed && state == STATE_HELD) {
+                state = STATE_IDLE;
+            }
+        } else if (now >= state_deadline_us) {
+            state_deadline_us = NO_DEADLINE;
+            if (state == STATE_PRESSED) {
+                emit(OWL_BUTTON_LONG_PRESS, press_us);
+                state = STATE_HELD;
+            } else if (state == STATE_WAIT_SECOND) {
+                emit(OWL_BUTTON_SINGLE_CLICK, press_us);
+                state = STATE_IDLE;
+            }
+        }
+
+        if (s_edges_dropped) {
+            ESP_LOGW(TAG, "Edge queue full (%" PRIu32 " dropped)", s_edges_dropped);
+            s_edges_dropped = 0;
+        }
+    }
 }
 
 void owl_button_init(int32_t gpio_num)
 {
-    owl_button_event_queue = xQueueCreate(4, sizeof(int));
-    button_config_t btn_cfg = { 0 };
-    button_gpio_config_t gpio_cfg = {
-        .gpio_num = gpio_num,
-        .active_level = 0,
-        .enable_power_save = false,
+    s_gpio = gpio_num;
+    owl_button_event_queue = OWL_QUEUE_CREATE(event_queue);
+    s_edge_queue = OWL_QUEUE_CREATE(edge_queue);
+
+    gpio_config_t io_conf = {
+        .pin_bit_mask = 1ULL << gpio_num,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
     };
+    ESP_ERROR_CHECK(gpio_config(&io_conf));
 
-    button_handle_t btn;
-    ESP_ERROR_CHECK(iot_button_new_gpio_device(&btn_cfg, &gpio_cfg, &btn));
+    OWL_TASK_CREATE(button_task,
+                    0,
+                    owl_button_task,
+                    "owl_button_task",
+                    NULL,
+                    TASK_PRIORITY,
+                    tskNO_AFFINITY);
 
-    ESP_ERROR_CHECK(iot_button_register_cb(
-        btn, BUTTON_SINGLE_CLICK, NULL, button_single_click_cb, NULL));
-    ESP_ERROR_CHECK(iot_button_register_cb(
-        btn, BUTTON_DOUBLE_CLICK, NULL, button_double_click_cb, NULL));
-    ESP_ERROR_CHECK(iot_button_register_cb(
-        btn, BUTTON_LONG_PRESS_START, NULL, button_long_press_cb, NULL));
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        ESP_ERROR_CHECK(ret);
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(gpio_num, button_isr, NULL));
 
     ESP_LOGI(TAG, "Initialized button (GPIO%" PRIi32 ")", gpio_num);
 }
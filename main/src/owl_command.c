@@ -0,0 +1,108 @@
+#include "owl_command.h"
+#include "owl_static.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "owl_command";
+
+#define MAX_SCAN_COUNT 10000
+#define MIN_MONITOR_PERIOD_MS 10
+
+QueueHandle_t owl_command_queue;
+OWL_QUEUE_DEFINE(command_queue, OWL_COMMAND_QUEUE_LEN, sizeof(owl_command_t));
+owl_onewire_cancel_t owl_command_cancel;
+
+// Command in progress, id 0 when idle. Checked and cancelled in one critical
+// section so a cancel never lands on the command started right after its check.
+static portMUX_TYPE s_running_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_running_id;
+static int s_running_fd = -1;
+
+void owl_command_init(void)
+{
+    owl_command_queue = OWL_QUEUE_CREATE(command_queue);
+    ESP_LOGI(TAG, "Initialized command queue (%d)", OWL_COMMAND_QUEUE_LEN);
+}
+
+void owl_command_begin(uint32_t id, int fd)
+{
+    portENTER_CRITICAL(&s_running_lock);
+    owl_onewire_cancel_begin(&owl_command_cancel);
+    s_running_id = id;
+    s_running_fd = fd;
+    portEXIT_CRITICAL(&s_running_lock);
+}
+
+void owl_command_end(void)
+{
+    portENTER_CRITICAL(&s_running_lock);
+    s_running_id = 0;
+    s_running_fd = -1;
+    portEXIT_CRITICAL(&s_running_lock);
+}
+
+bool owl_command_cancel_running(uint32_t id, int fd)
+{
+    portENTER_CRITICAL(&s_running_lock);
+    bool running = id != 0 && id == s_running_id && fd == s_running_fd;
+    if (running) {
+        owl_onewire_cancel_request(&owl_command_cancel);
+    }
+    portEXIT_CRITICAL(&s_running_lock);
+    return running;
+}
+
+esp_err_t owl_command_parse(const char *s, owl_command_t *cmd)
+{
+    char verb[12];
+    int32_t arg;
+
+    int read = sscanf(s, "%" SCNu32 " %11s %" SCNi32, &cmd->id, verb, &arg);
+    if (read < 2 || cmd->id == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (strcmp(verb, "scan") == 0) {
+        cmd->type = OWL_COMMAND_SCAN;
+        cmd->arg = read == 3 ? arg : 1;
+        if (cmd->arg < 1 || cmd->arg > MAX_SCAN_COUNT) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    } else if (strcmp(verb, "monitor") == 0) {
+        cmd->type = OWL_COMMAND_MONITOR_START;
+        cmd->arg = arg;
+        if (read != 3 || arg < MIN_MONITOR_PERIOD_MS) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    } else if (strcmp(verb, "stop") == 0) {
+        cmd->type = OWL_COMMAND_MONITOR_STOP;
+        cmd->arg = 0;
+    } else if (strcmp(verb, "bus") == 0) {
+        cmd->type = OWL_COMMAND_SELECT_BUS;
+        cmd->arg = arg;
+        if (read != 3 || arg < 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    } else if (strcmp(verb, "calibrate") == 0) {
+        cmd->type = OWL_COMMAND_CALIBRATE;
+        cmd->arg = 0;
+    } else if (strcmp(verb, "cancel") == 0) {
+        // Ids span the full uint32_t range, parsed apart from `arg`
+        uint32_t target;
+        cmd->type = OWL_COMMAND_CANCEL;
+        if (sscanf(s, "%*" SCNu32 " %*s %" SCNu32, &target) != 1
+            || target == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        cmd->arg = (int32_t) target;
+    } else {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    return ESP_OK;
+}
@@ -2,12 +2,25 @@
 #include "freertos/idf_additions.h"
 #include "freertos/projdefs.h"
 #include "owl_lcd.h"
+#include "owl_mem.h"
+#include "owl_metrics.h"
+#include "owl_static.h"
 #include "portmacro.h"
 #include <stdbool.h>
 #include <string.h>
 
+#define TASK_STACK_SIZE 4096
+#define TASK_PRIORITY 5
+
 QueueHandle_t owl_display_event_queue;
 
+OWL_QUEUE_DEFINE(display_queue, 2, sizeof(owl_display_event_t));
+OWL_TASK_DEFINE(display_task, TASK_STACK_SIZE, 1);
+
+OWL_METRIC_COUNTER_DEFINE(dropped_metric,
+                          "owl_display_dropped_total",
+                          "Messages dropped because the display was busy");
+
 static void owl_display_task(void *arg)
 {
     owl_display_event_t e;
@@ -58,12 +71,22 @@ static void owl_display_task(void *arg)
 
 void owl_display_init()
 {
+    owl_metrics_register(&dropped_metric);
+
 #ifdef CONFIG_OWL_USE_LCD
     owl_lcd_init();
 #endif
 
-    owl_display_event_queue = xQueueCreate(2, sizeof(owl_display_event_t));
-    xTaskCreate(owl_display_task, "owl_display_task", 4096, NULL, 5, NULL);
+    size_t mem = owl_mem_track_begin();
+    owl_display_event_queue = OWL_QUEUE_CREATE(display_queue);
+    OWL_TASK_CREATE(display_task,
+                    0,
+                    owl_display_task,
+                    "owl_display_task",
+                    NULL,
+                    TASK_PRIORITY,
+                    tskNO_AFFINITY);
+    owl_mem_track_end(OWL_MEM_DISPLAY, mem);
 }
 
 void owl_display(const char *line0,
@@ -74,5 +97,7 @@ void owl_display(const char *line0,
     owl_display_event_t e = { {}, color, duration_ms };
     strncpy(e.message[0], line0, 17);
     strncpy(e.message[1], line1, 17);
-    xQueueSend(owl_display_event_queue, &e, 0);
+    if (xQueueSend(owl_display_event_queue, &e, 0) != pdTRUE) {
+        owl_metric_inc(&dropped_metric);
+    }
 }
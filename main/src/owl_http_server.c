@@ -1,38 +1,305 @@
 #include "owl_http_server.h"
+#include "owl_command.h"
+#include "owl_log.h"
+#include "owl_mem.h"
+#include "owl_metrics.h"
+#include "owl_pipeline.h"
+#include "owl_pool.h"
+#include "owl_scanlog.h"
+#include "owl_static.h"
+#include "owl_trace.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 
 static const char *TAG = "owl_http_server";
 
+#define ASYNC_WORKER_COUNT CONFIG_OWL_HTTP_ASYNC_WORKERS
+#define ASYNC_WORKER_STACK_SIZE 4096
+#define ASYNC_WORKER_PRIORITY 4
+
+#define FRAME_POOL_BLOCK_SIZE CONFIG_OWL_POOL_FRAME_SIZE
+// Frames past the pool block size up to this are still read, to be answered
+// with an error, larger ones end the session
+#define FRAME_DRAIN_MAX_LEN 1024
+
+// httpd_start() fails past this, httpd keeps 3 sockets for itself
+_Static_assert(CONFIG_OWL_HTTP_MAX_SOCKETS <= CONFIG_LWIP_MAX_SOCKETS - 3,
+               "CONFIG_OWL_HTTP_MAX_SOCKETS exceeds CONFIG_LWIP_MAX_SOCKETS - 3");
+
 static httpd_handle_t server_handle = NULL;
-static int ws_fd = -1;
 
+OWL_METRIC_COUNTER_DEFINE(ws_sends_metric,
+                          "owl_ws_sends_total",
+                          "WebSocket messages sent");
+OWL_METRIC_COUNTER_DEFINE(ws_failures_metric,
+                          "owl_ws_send_failures_total",
+                          "WebSocket messages not delivered");
+
+// Incoming WS frames (commands), null terminated
+OWL_POOL_DEFINE(frame_pool,
+                "ws_frame",
+                FRAME_POOL_BLOCK_SIZE,
+                CONFIG_OWL_POOL_FRAME_COUNT);
+
+#define UI_PATH "/spiffs/index.html"
+#define UI_TMP_PATH "/spiffs/index.tmp"
+#define UI_MAX_SIZE (64 * 1024)
+#define UI_CHUNK_SIZE 1024
+
+// Web UI, loaded from SPIFFS and replaceable at runtime through `/ui`
 static char *index_html = NULL;
 static size_t index_html_size = 0;
+static SemaphoreHandle_t index_html_lock;
+OWL_MUTEX_DEFINE(index_html_mutex);
+
+static esp_err_t load_index_html(void);
+static esp_err_t spiffs_mount(void);
+static void spiffs_unmount(void);
+
+// Endpoint dispatch
+//
+// Every URI is registered through `endpoint_handler`, which times the request
+// and, for endpoints marked `async`, hands it off to a worker so the httpd task
+// stays free to serve other clients.
+
+typedef struct {
+    esp_err_t (*handler)(httpd_req_t *req);
+    bool async;
+    // latency stats, guarded by `stats_lock`
+    uint32_t count;
+    uint32_t errors;
+    uint64_t total_us;
+    uint32_t max_us;
+} owl_endpoint_t;
+
+typedef struct {
+    httpd_req_t *req;
+    owl_endpoint_t *endpoint;
+    int64_t start_us;
+} async_req_t;
+
+static QueueHandle_t async_req_queue;
+static SemaphoreHandle_t async_workers_ready;
+OWL_QUEUE_DEFINE(async_queue, ASYNC_WORKER_COUNT, sizeof(async_req_t));
+OWL_SEMAPHORE_DEFINE(async_ready, ASYNC_WORKER_COUNT, 0);
+OWL_TASK_DEFINE(async_worker, ASYNC_WORKER_STACK_SIZE, ASYNC_WORKER_COUNT);
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void endpoint_record(owl_endpoint_t *endpoint,
+                            int64_t start_us,
+                            esp_err_t ret)
+{
+    uint32_t elapsed_us = esp_timer_get_time() - start_us;
+
+    portENTER_CRITICAL(&stats_lock);
+    endpoint->count++;
+    endpoint->errors += ret != ESP_OK;
+    endpoint->total_us += elapsed_us;
+    if (elapsed_us > endpoint->max_us) {
+        endpoint->max_us = elapsed_us;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static void async_worker_task(void *arg)
+{
+    async_req_t async_req;
+
+    while (1) {
+        xSemaphoreGive(async_workers_ready);
+        if (xQueueReceive(async_req_queue, &async_req, portMAX_DELAY)) {
+            esp_err_t ret = async_req.endpoint->handler(async_req.req);
+            endpoint_record(async_req.endpoint, async_req.start_us, ret);
+            httpd_req_async_handler_complete(async_req.req);
+        }
+    }
+}
+
+static esp_err_t submit_async_req(httpd_req_t *req,
+                                  owl_endpoint_t *endpoint,
+                                  int64_t start_us)
+{
+    // Don't wait for a worker - the httpd task must never block
+    if (xSemaphoreTake(async_workers_ready, 0) != pdTRUE) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+
+    async_req_t async_req = {
+        .endpoint = endpoint,
+        .start_us = start_us,
+    };
+    esp_err_t ret = httpd_req_async_handler_begin(req, &async_req.req);
+    if (ret != ESP_OK) {
+        xSemaphoreGive(async_workers_ready);
+        return ret;
+    }
+
+    if (xQueueSend(async_req_queue, &async_req, 0) != pdTRUE) {
+        httpd_req_async_handler_complete(async_req.req);
+        xSemaphoreGive(async_workers_ready);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t endpoint_handler(httpd_req_t *req)
+{
+    owl_endpoint_t *endpoint = req->user_ctx;
+    int64_t start_us = esp_timer_get_time();
+
+    if (endpoint->async) {
+        esp_err_t ret = submit_async_req(req, endpoint, start_us);
+        if (ret == ESP_OK) {
+            return ESP_OK;
+        }
+
+        ESP_LOGW(TAG,
+                 "No async worker for %s: %s",
+                 req->uri,
+                 esp_err_to_name(ret));
+        httpd_resp_set_status(req, HTTPD_503);
+        httpd_resp_send(req, "Server busy", HTTPD_RESP_USE_STRLEN);
+        endpoint_record(endpoint, start_us, ret);
+        return ESP_OK;
+    }
+
+    esp_err_t ret = endpoint->handler(req);
+    endpoint_record(endpoint, start_us, ret);
+    return ret;
+}
+
+static void async_workers_init(void)
+{
+    async_req_queue = OWL_QUEUE_CREATE(async_queue);
+    async_workers_ready = OWL_SEMAPHORE_CREATE(async_ready);
+
+    for (size_t i = 0; i < ASYNC_WORKER_COUNT; i++) {
+        OWL_TASK_CREATE(async_worker,
+                        i,
+                        async_worker_task,
+                        "owl_http_worker",
+                        NULL,
+                        ASYNC_WORKER_PRIORITY,
+                        tskNO_AFFINITY);
+    }
+}
+
+// Endpoints
 
 static esp_err_t root_get_handler(httpd_req_t *req)
 {
     httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, index_html, index_html_size);
-    return ESP_OK;
+    xSemaphoreTake(index_html_lock, portMAX_DELAY);
+    esp_err_t ret = httpd_resp_send(req, index_html, index_html_size);
+    xSemaphoreGive(index_html_lock);
+    return ret;
 }
 
-static httpd_uri_t root = {
+static owl_endpoint_t root_endpoint = {
+    .handler = root_get_handler,
+};
+
+static const httpd_uri_t root = {
     .uri = "/",
     .method = HTTP_GET,
-    .handler = root_get_handler,
-    .user_ctx = NULL,
+    .handler = endpoint_handler,
+    .user_ctx = &root_endpoint,
 };
 
+static esp_err_t ws_reply(httpd_req_t *req, const char *fmt, ...)
+{
+    char buff[32];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buff, sizeof(buff), fmt, args);
+    va_end(args);
+
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .fragmented = false,
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t *) buff,
+        .len = strlen(buff),
+    };
+    return httpd_ws_send_frame(req, &frame);
+}
+
+static esp_err_t handle_command(httpd_req_t *req, const char *s)
+{
+    owl_command_t cmd = {
+        .fd = httpd_req_to_sockfd(req),
+    };
+
+    esp_err_t ret = owl_command_parse(s, &cmd);
+    if (ret != ESP_OK) {
+        OWL_LOGW(TAG, "Invalid command: %s", s);
+        return ws_reply(req,
+                        "%" PRIu32 " err %s",
+                        cmd.id,
+                        ret == ESP_ERR_NOT_SUPPORTED ? "unknown" : "invalid");
+    }
+
+    if (cmd.type == OWL_COMMAND_CANCEL) {
+        // Answered here, the command it aborts holds the queue
+        return ws_reply(req,
+                        "%" PRIu32 " %s",
+                        cmd.id,
+                        owl_command_cancel_running((uint32_t) cmd.arg, cmd.fd)
+                            ? "ok"
+                            : "err not running");
+    }
+
+    if (xQueueSend(owl_command_queue, &cmd, 0) != pdTRUE) {
+        OWL_LOGW(TAG, "Command queue full, rejecting %" PRIu32, cmd.id);
+        return ws_reply(req, "%" PRIu32 " err busy", cmd.id);
+    }
+    return ESP_OK;
+}
+
+// Reads an oversized frame so the session survives it, and rejects the command
+// it carries
+static esp_err_t reject_frame(httpd_req_t *req, httpd_ws_frame_t *frame)
+{
+    OWL_LOGW(TAG, "WS frame too large: %zu", frame->len);
+    if (frame->len > FRAME_DRAIN_MAX_LEN) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    frame->payload = owl_malloc(OWL_MEM_HTTP, frame->len + 1);
+    if (!frame->payload) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t ret = httpd_ws_recv_frame(req, frame, frame->len);
+    if (ret == ESP_OK && frame->type == HTTPD_WS_TYPE_TEXT) {
+        uint32_t id = 0;
+        frame->payload[frame->len] = '\0';
+        sscanf((char *) frame->payload, "%" SCNu32, &id);
+        ret = ws_reply(req, "%" PRIu32 " err invalid", id);
+    }
+    owl_free(OWL_MEM_HTTP, frame->payload);
+    return ret;
+}
+
 static esp_err_t ws_handler(httpd_req_t *req)
 {
     if (req->method == HTTP_GET) {
-        ws_fd = httpd_req_to_sockfd(req);
-        ESP_LOGI(TAG, "WS handshake done (fd = %d)", ws_fd);
+        OWL_LOGI(TAG, "WS handshake done (fd = %d)", httpd_req_to_sockfd(req));
         return ESP_OK;
     }
 
@@ -44,38 +311,48 @@ static esp_err_t ws_handler(httpd_req_t *req)
 
     esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to get frame length: %s", esp_err_to_name(ret));
+        OWL_LOGE(TAG, "Failed to get frame length: %s", esp_err_to_name(ret));
         return ret;
     }
 
+    if (frame.len >= FRAME_POOL_BLOCK_SIZE) {
+        return reject_frame(req, &frame);
+    }
+
     if (frame.len > 0) {
-        frame.payload = malloc(frame.len + 1);
+        frame.payload = owl_pool_alloc(&frame_pool);
         if (!frame.payload)
             return ESP_ERR_NO_MEM;
 
         ret = httpd_ws_recv_frame(req, &frame, frame.len);
         if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to read WS frame: %s", esp_err_to_name(ret));
-            free(frame.payload);
+            OWL_LOGE(TAG, "Failed to read WS frame: %s", esp_err_to_name(ret));
+            owl_pool_free(&frame_pool, frame.payload);
             return ret;
         }
         frame.payload[frame.len] = '\0';
-        ESP_LOGI(TAG, "Received: %s", (char *) frame.payload);
-        free(frame.payload);
+        OWL_LOGI(TAG, "Received: %s", (char *) frame.payload);
+        if (frame.type == HTTPD_WS_TYPE_TEXT) {
+            ret = handle_command(req, (char *) frame.payload);
+        }
+        owl_pool_free(&frame_pool, frame.payload);
     }
 
     if (frame.type == HTTPD_WS_TYPE_CLOSE) {
-        ESP_LOGI(TAG, "WS closed");
-        ws_fd = -1;
+        OWL_LOGI(TAG, "WS closed (fd = %d)", httpd_req_to_sockfd(req));
     }
     return ret;
 }
 
+static owl_endpoint_t ws_endpoint = {
+    .handler = ws_handler,
+};
+
 static const httpd_uri_t ws = {
     .uri = "/ws",
     .method = HTTP_GET,
-    .handler = ws_handler,
-    .user_ctx = NULL,
+    .handler = endpoint_handler,
+    .user_ctx = &ws_endpoint,
     .is_websocket = true,
 };
 
@@ -143,29 +420,516 @@ internal_server_error:
     return ESP_FAIL;
 }
 
+// Calls into the WiFi driver, which may take a while
+static owl_endpoint_t cfg_endpoint = {
+    .handler = config_handler,
+    .async = true,
+};
+
 static const httpd_uri_t cfg = {
     .uri = "/cfg",
     .method = HTTP_POST,
-    .handler = config_handler,
+    .handler = endpoint_handler,
+    .user_ctx = &cfg_endpoint,
+};
+
+static esp_err_t stats_handler(httpd_req_t *req);
+
+static owl_endpoint_t stats_endpoint = {
+    .handler = stats_handler,
+};
+
+static const httpd_uri_t stats = {
+    .uri = "/stats",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &stats_endpoint,
 };
 
+static esp_err_t mem_handler(httpd_req_t *req)
+{
+    char line[96];
+
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_free = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    httpd_resp_set_type(req, "text/plain");
+    snprintf(line,
+             sizeof(line),
+             "heap free=%zu min_free=%zu largest_free=%zu frag=%zu%%\n",
+             free_size,
+             heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+             largest_free,
+             free_size ? 100 - largest_free * 100 / free_size : 0);
+    httpd_resp_sendstr_chunk(req, line);
+
+    for (size_t tag = 0; tag < OWL_MEM_TAG_COUNT; tag++) {
+        owl_mem_stats_t stats;
+        owl_mem_stats(tag, &stats);
+        snprintf(line,
+                 sizeof(line),
+                 "tag %s current=%zu peak=%zu\n",
+                 owl_mem_tag_name(tag),
+                 stats.current,
+                 stats.peak);
+        httpd_resp_sendstr_chunk(req, line);
+    }
+
+    for (const owl_pool_t *pool = owl_pool_next(NULL); pool;
+         pool = owl_pool_next(pool)) {
+        snprintf(line,
+                 sizeof(line),
+                 "pool %s blocks=%zu size=%zu used=%zu peak=%zu failures=%" PRIu32
+                 "\n",
+                 pool->name,
+                 pool->block_count,
+                 pool->block_size,
+                 pool->used,
+                 pool->peak,
+                 pool->failures);
+        httpd_resp_sendstr_chunk(req, line);
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+static owl_endpoint_t mem_endpoint = {
+    .handler = mem_handler,
+};
+
+static const httpd_uri_t mem = {
+    .uri = "/mem",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &mem_endpoint,
+};
+
+static void metrics_emit(const char *line, void *ctx)
+{
+    httpd_resp_sendstr_chunk((httpd_req_t *) ctx, line);
+}
+
+// Prometheus text exposition format
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    owl_metrics_format(metrics_emit, req);
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+static owl_endpoint_t metrics_endpoint = {
+    .handler = metrics_handler,
+};
+
+static const httpd_uri_t metrics = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &metrics_endpoint,
+};
+
+// Replaces the web UI: the body is written next to the current page, swapped in
+// and reloaded, so the page can be updated without reflashing
+static esp_err_t ui_upload_handler(httpd_req_t *req)
+{
+    if (req->content_len == 0 || req->content_len > UI_MAX_SIZE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid UI size");
+        return ESP_FAIL;
+    }
+
+    char *chunk = owl_malloc(OWL_MEM_HTTP, UI_CHUNK_SIZE);
+    if (!chunk || spiffs_mount() != ESP_OK) {
+        owl_free(OWL_MEM_HTTP, chunk);
+        goto internal_server_error;
+    }
+
+    FILE *file = fopen(UI_TMP_PATH, "w");
+    if (!file) {
+        ESP_LOGE(TAG, "Failed to create %s", UI_TMP_PATH);
+        owl_free(OWL_MEM_HTTP, chunk);
+        spiffs_unmount();
+        goto internal_server_error;
+    }
+
+    size_t remaining = req->content_len;
+    while (remaining > 0) {
+        int ret = httpd_req_recv(
+            req, chunk, remaining < UI_CHUNK_SIZE ? remaining : UI_CHUNK_SIZE);
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        if (ret <= 0 || fwrite(chunk, 1, ret, file) != (size_t) ret) {
+            break;
+        }
+        remaining -= ret;
+    }
+    fclose(file);
+    owl_free(OWL_MEM_HTTP, chunk);
+
+    esp_err_t ret = ESP_FAIL;
+    if (remaining == 0) {
+        // SPIFFS can't rename over an existing file. If power is lost in
+        // between, the temporary file is picked up at boot.
+        unlink(UI_PATH);
+        if (rename(UI_TMP_PATH, UI_PATH) == 0) {
+            ret = load_index_html();
+        }
+    } else {
+        ESP_LOGE(TAG, "UI upload interrupted (%zu bytes missing)", remaining);
+        unlink(UI_TMP_PATH);
+    }
+    spiffs_unmount();
+
+    if (ret != ESP_OK) {
+        goto internal_server_error;
+    }
+    ESP_LOGI(TAG, "Updated UI (%zu bytes)", index_html_size);
+    return httpd_resp_sendstr(req, "Updated UI");
+
+internal_server_error:
+    httpd_resp_send_err(
+        req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to update UI");
+    return ESP_FAIL;
+}
+
+// Receives and writes flash, which may take a while
+static owl_endpoint_t ui_endpoint = {
+    .handler = ui_upload_handler,
+    .async = true,
+};
+
+static const httpd_uri_t ui = {
+    .uri = "/ui",
+    .method = HTTP_POST,
+    .handler = endpoint_handler,
+    .user_ctx = &ui_endpoint,
+};
+
+#define LOG_DEFAULT_COUNT 100
+#define LOG_MAX_COUNT 1000
+
+// Reads flash, streams `?count=` records (default the last 100) starting at
+// `?from=`
+static esp_err_t log_handler(httpd_req_t *req)
+{
+    uint32_t first_seq, next_seq;
+    owl_scanlog_range(&first_seq, &next_seq);
+
+    uint32_t count = LOG_DEFAULT_COUNT;
+    uint32_t from = next_seq - first_seq > count ? next_seq - count : first_seq;
+
+    char query[48], value[12];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "count", value, sizeof(value))
+            == ESP_OK) {
+            count = strtoul(value, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "from", value, sizeof(value))
+            == ESP_OK) {
+            from = strtoul(value, NULL, 10);
+        }
+    }
+    if (count > LOG_MAX_COUNT) {
+        count = LOG_MAX_COUNT;
+    }
+    if (from < first_seq) {
+        from = first_seq;
+    }
+
+    char line[80];
+    httpd_resp_set_type(req, "text/plain");
+    snprintf(line,
+             sizeof(line),
+             "# first=%" PRIu32 " next=%" PRIu32 "\n# seq,id,timestamp_us,rom\n",
+             first_seq,
+             next_seq);
+    httpd_resp_sendstr_chunk(req, line);
+
+    for (uint32_t seq = from; seq < next_seq && seq - from < count; seq++) {
+        owl_scanlog_record_t record;
+        if (owl_scanlog_read(seq, &record) != ESP_OK) {
+            continue;
+        }
+        snprintf(line,
+                 sizeof(line),
+                 "%" PRIu32 ",%" PRIu32 ",%" PRId64 ",%016" PRIX64 "\n",
+                 record.seq,
+                 record.id,
+                 record.timestamp_us,
+                 record.rom);
+        httpd_resp_sendstr_chunk(req, line);
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+static owl_endpoint_t log_endpoint = {
+    .handler = log_handler,
+    .async = true,
+};
+
+static const httpd_uri_t log_uri = {
+    .uri = "/log",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &log_endpoint,
+};
+
+#ifdef CONFIG_OWL_LOG_DEFERRED
+#define CONSOLE_DUMP_SIZE (CONFIG_OWL_LOG_RING_SIZE + sizeof(owl_log_dump_header_t))
+
+static owl_endpoint_t console_bin_endpoint;
+
+static void console_emit(const char *line, void *ctx)
+{
+    httpd_resp_sendstr_chunk(ctx, line);
+}
+
+// Deferred log records, formatted on the device (`/console`) or raw for
+// tools/owl_log_decode.py (`/console.bin`)
+static esp_err_t console_handler(httpd_req_t *req)
+{
+    uint8_t *dump = owl_malloc(OWL_MEM_HTTP, CONSOLE_DUMP_SIZE);
+    if (!dump) {
+        httpd_resp_send_err(
+            req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_ERR_NO_MEM;
+    }
+    size_t len = owl_log_dump(dump, CONSOLE_DUMP_SIZE);
+
+    esp_err_t ret;
+    if (req->user_ctx == &console_bin_endpoint) {
+        httpd_resp_set_type(req, "application/octet-stream");
+        ret = httpd_resp_send(req, (const char *) dump, len);
+    } else {
+        httpd_resp_set_type(req, "text/plain");
+        owl_log_format_dump(dump, len, console_emit, req);
+        ret = httpd_resp_sendstr_chunk(req, NULL);
+    }
+    owl_free(OWL_MEM_HTTP, dump);
+    return ret;
+}
+
+static owl_endpoint_t console_endpoint = {
+    .handler = console_handler,
+    .async = true,
+};
+
+static const httpd_uri_t console = {
+    .uri = "/console",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &console_endpoint,
+};
+
+static owl_endpoint_t console_bin_endpoint = {
+    .handler = console_handler,
+    .async = true,
+};
+
+static const httpd_uri_t console_bin = {
+    .uri = "/console.bin",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &console_bin_endpoint,
+};
+#endif
+
+#ifdef CONFIG_OWL_TRACE
+static esp_err_t trace_handler(httpd_req_t *req)
+{
+    uint32_t buckets[OWL_TRACE_BUCKETS];
+    char line[32];
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr_chunk(req, "# stage count [le_us:count ...]\n");
+    for (size_t stage = 0; stage < OWL_TRACE_STAGE_COUNT; stage++) {
+        owl_trace_histogram(stage, buckets);
+
+        uint32_t count = 0;
+        for (size_t i = 0; i < OWL_TRACE_BUCKETS; i++) {
+            count += buckets[i];
+        }
+        snprintf(line,
+                 sizeof(line),
+                 "%s %" PRIu32,
+                 owl_trace_stage_name(stage),
+                 count);
+        httpd_resp_sendstr_chunk(req, line);
+
+        for (size_t i = 0; i < OWL_TRACE_BUCKETS; i++) {
+            if (buckets[i] == 0) {
+                continue;
+            }
+            snprintf(line,
+                     sizeof(line),
+                     " %" PRIu32 ":%" PRIu32,
+                     (uint32_t) 1 << i,
+                     buckets[i]);
+            httpd_resp_sendstr_chunk(req, line);
+        }
+        httpd_resp_sendstr_chunk(req, "\n");
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+static owl_endpoint_t trace_endpoint = {
+    .handler = trace_handler,
+};
+
+static const httpd_uri_t trace = {
+    .uri = "/trace",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &trace_endpoint,
+};
+
+// Chrome trace event format, loadable in Perfetto / chrome://tracing
+static esp_err_t trace_json_handler(httpd_req_t *req)
+{
+    const size_t max_spans = CONFIG_OWL_TRACE_RING_LEN * portNUM_PROCESSORS;
+    owl_trace_span_t *spans
+        = owl_malloc(OWL_MEM_HTTP, max_spans * sizeof(owl_trace_span_t));
+    if (!spans) {
+        httpd_resp_send_err(
+            req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_ERR_NO_MEM;
+    }
+    size_t count = owl_trace_snapshot(spans, max_spans);
+
+    char event[128];
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "{\"traceEvents\":[");
+    for (size_t i = 0; i < count; i++) {
+        snprintf(event,
+                 sizeof(event),
+                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+                 "\"ts\":%" PRId64 ",\"dur\":%" PRIu32
+                 ",\"args\":{\"trace\":%u}}",
+                 i ? "," : "",
+                 owl_trace_stage_name(spans[i].stage),
+                 spans[i].core,
+                 spans[i].start_us,
+                 spans[i].duration_us,
+                 spans[i].trace_id);
+        httpd_resp_sendstr_chunk(req, event);
+    }
+    owl_free(OWL_MEM_HTTP, spans);
+
+    httpd_resp_sendstr_chunk(req, "]}");
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+static owl_endpoint_t trace_json_endpoint = {
+    .handler = trace_json_handler,
+    .async = true,
+};
+
+static const httpd_uri_t trace_json = {
+    .uri = "/trace.json",
+    .method = HTTP_GET,
+    .handler = endpoint_handler,
+    .user_ctx = &trace_json_endpoint,
+};
+#endif
+
+static const httpd_uri_t *const endpoints[] = {
+    &root,
+    &ws,
+    &cfg,
+    &ui,
+    &stats,
+    &mem,
+    &metrics,
+    &log_uri,
+#ifdef CONFIG_OWL_LOG_DEFERRED
+    &console,
+    &console_bin,
+#endif
+#ifdef CONFIG_OWL_TRACE
+    &trace,
+    &trace_json,
+#endif
+};
+
+static esp_err_t stats_handler(httpd_req_t *req)
+{
+    char line[96];
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr_chunk(req, "# uri count errors avg_us max_us\n");
+    for (size_t i = 0; i < sizeof(endpoints) / sizeof(endpoints[0]); i++) {
+        owl_endpoint_t *endpoint = endpoints[i]->user_ctx;
+
+        portENTER_CRITICAL(&stats_lock);
+        owl_endpoint_t snapshot = *endpoint;
+        portEXIT_CRITICAL(&stats_lock);
+
+        snprintf(line,
+                 sizeof(line),
+                 "%s %" PRIu32 " %" PRIu32 " %" PRIu64 " %" PRIu32 "\n",
+                 endpoints[i]->uri,
+                 snapshot.count,
+                 snapshot.errors,
+                 snapshot.count ? snapshot.total_us / snapshot.count : 0,
+                 snapshot.max_us);
+        httpd_resp_sendstr_chunk(req, line);
+    }
+
+    static const char *const policies[] = {
+        [OWL_OVERFLOW_DROP_NEWEST] = "drop_newest",
+        [OWL_OVERFLOW_DROP_OLDEST] = "drop_oldest",
+        [OWL_OVERFLOW_BLOCK] = "block",
+    };
+    httpd_resp_sendstr_chunk(req, "# queue policy pushed dropped waiting\n");
+    owl_pipeline_queue_stats_t queue;
+    for (size_t i = 0; owl_pipeline_queue_stats(i, &queue); i++) {
+        snprintf(line,
+                 sizeof(line),
+                 "%s %s %" PRIu32 " %" PRIu32 " %zu\n",
+                 queue.name,
+                 policies[queue.policy],
+                 queue.pushed,
+                 queue.dropped,
+                 queue.waiting);
+        httpd_resp_sendstr_chunk(req, line);
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
 static httpd_handle_t start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     httpd_handle_t server = NULL;
 
+    // Serve several concurrent clients (browser tabs keep a WS open each),
+    // evicting the least recently used socket rather than refusing new ones
+    config.max_open_sockets = CONFIG_OWL_HTTP_MAX_SOCKETS;
+    config.lru_purge_enable = true;
+    config.max_uri_handlers = sizeof(endpoints) / sizeof(endpoints[0]);
+
+    async_workers_init();
+
     if (httpd_start(&server, &config) == ESP_OK) {
-        httpd_register_uri_handler(server, &root);
-        httpd_register_uri_handler(server, &ws);
-        httpd_register_uri_handler(server, &cfg);
+        for (size_t i = 0; i < sizeof(endpoints) / sizeof(endpoints[0]);
+             i++) {
+            httpd_register_uri_handler(server, endpoints[i]);
+        }
     }
     return server;
 }
 
-void owl_ws_send(const char *message)
+static void ws_send_to(int fd, httpd_ws_frame_t *frame)
 {
-    if (ws_fd < 0 || server_handle == NULL) {
-        ESP_LOGE(TAG, "No active WS connection");
+    esp_err_t ret = httpd_ws_send_frame_async(server_handle, fd, frame);
+    if (ret != ESP_OK) {
+        owl_metric_inc(&ws_failures_metric);
+        OWL_LOGE(TAG, "Failed to send WS message: %s", esp_err_to_name(ret));
+        return;
+    }
+    owl_metric_inc(&ws_sends_metric);
+}
+
+void owl_ws_send(int fd, const char *message)
+{
+    if (server_handle == NULL) {
         return;
     }
 
@@ -177,41 +941,71 @@ void owl_ws_send(const char *message)
         .len = strlen(message),
     };
 
-    esp_err_t ret = httpd_ws_send_frame_async(server_handle, ws_fd, &ws_pkt);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to send WS message: %s", esp_err_to_name(ret));
-        ws_fd = -1;
+    if (fd >= 0) {
+        // The client may have gone, and its socket been reused since
+        if (httpd_ws_get_fd_info(server_handle, fd)
+            != HTTPD_WS_CLIENT_WEBSOCKET) {
+            owl_metric_inc(&ws_failures_metric);
+            OWL_LOGE(TAG, "No active WS connection (fd = %d)", fd);
+            return;
+        }
+        ws_send_to(fd, &ws_pkt);
+        return;
+    }
+
+    int fds[CONFIG_OWL_HTTP_MAX_SOCKETS];
+    size_t count = sizeof(fds) / sizeof(fds[0]);
+    if (httpd_get_client_list(server_handle, &count, fds) != ESP_OK) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (httpd_ws_get_fd_info(server_handle, fds[i])
+            == HTTPD_WS_CLIENT_WEBSOCKET) {
+            ws_send_to(fds[i], &ws_pkt);
+        }
     }
 }
 
-static esp_err_t load_index_html()
+// Loads the UI into RAM, falling back to the temporary file left behind if an
+// upload was cut short between removing the old page and renaming the new one
+static esp_err_t load_index_html(void)
 {
     ESP_LOGI(TAG, "Reading index.html");
-    FILE *file = fopen("/spiffs/index.html", "r");
+    FILE *file = fopen(UI_PATH, "r");
+    if (!file) {
+        file = fopen(UI_TMP_PATH, "r");
+    }
     if (!file) {
         ESP_LOGE(TAG, "Failed to open index.html");
         return ESP_FAIL;
     }
 
     fseek(file, 0, SEEK_END);
-    index_html_size = ftell(file);
+    size_t size = ftell(file);
     rewind(file);
 
-    index_html = malloc(index_html_size + 1);
-    if (!index_html) {
+    char *html = owl_malloc(OWL_MEM_HTTP, size + 1);
+    if (!html) {
         ESP_LOGE(TAG, "Memory allocation for index.html failed");
         fclose(file);
         return ESP_ERR_NO_MEM;
     }
 
-    fread(index_html, 1, index_html_size, file);
-    index_html[index_html_size] = '\0'; // Null-terminate
+    fread(html, 1, size, file);
+    html[size] = '\0'; // Null-terminate
     fclose(file);
 
+    xSemaphoreTake(index_html_lock, portMAX_DELAY);
+    char *old_html = index_html;
+    index_html = html;
+    index_html_size = size;
+    xSemaphoreGive(index_html_lock);
+    owl_free(OWL_MEM_HTTP, old_html);
+
     return ESP_OK;
 }
 
-static void handle_spiffs()
+static esp_err_t spiffs_mount(void)
 {
     esp_vfs_spiffs_conf_t conf = {
         .base_path = "/spiffs",
@@ -220,21 +1014,42 @@ static void handle_spiffs()
         .format_if_mount_failed = false,
     };
 
-    ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));
+    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount SPIFFS: %s", esp_err_to_name(ret));
+        return ret;
+    }
 
     size_t total = 0, used = 0;
     ESP_ERROR_CHECK(esp_spiffs_info(NULL, &total, &used));
     ESP_LOGI(TAG, "Partition size: total: %zu, used: %zu", total, used);
+    return ESP_OK;
+}
 
-    ESP_ERROR_CHECK(load_index_html());
-
+static void spiffs_unmount(void)
+{
     ESP_ERROR_CHECK(esp_vfs_spiffs_unregister(NULL));
     ESP_LOGI(TAG, "SPIFFS unmounted");
 }
 
+static void handle_spiffs()
+{
+    ESP_ERROR_CHECK(spiffs_mount());
+    ESP_ERROR_CHECK(load_index_html());
+    spiffs_unmount();
+}
+
 void owl_http_server_init()
 {
+    owl_pool_init(&frame_pool);
+    index_html_lock = OWL_MUTEX_CREATE(index_html_mutex);
+    owl_metrics_register(&ws_sends_metric);
+    owl_metrics_register(&ws_failures_metric);
+
+    size_t mem = owl_mem_track_begin();
     server_handle = start_webserver();
+    owl_mem_track_end(OWL_MEM_HTTP, mem);
+
     handle_spiffs();
     ESP_LOGI(TAG, "Initialized HTTP server");
 }
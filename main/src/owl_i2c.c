@@ -0,0 +1,305 @@
+#include "owl_i2c.h"
+#include "owl_static.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "driver/i2c_master.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "owl_i2c";
+
+#define SDA_GPIO CONFIG_OWL_I2C_SDA_GPIO
+#define SCL_GPIO CONFIG_OWL_I2C_SCL_GPIO
+#define QUEUE_LEN CONFIG_OWL_I2C_QUEUE_LEN
+#define TIMEOUT_MS CONFIG_OWL_I2C_TIMEOUT_MS
+#define SUSPEND_TICKS pdMS_TO_TICKS(CONFIG_OWL_I2C_SUSPEND_MS)
+
+#define WORKER_STACK_SIZE 3072
+// Below every scan pipeline stage
+#define WORKER_PRIORITY 2
+
+struct owl_i2c_device {
+    i2c_master_dev_handle_t handle;
+    uint16_t address;
+    uint8_t priority;
+    uint8_t max_pending;
+    uint8_t error_budget;
+    owl_metric_t *errors;
+    const owl_i2c_transfer_t *init;
+    size_t init_count;
+    uint32_t pending; // queued writes, atomic
+    // Worker state, `suspended_until` is also read by writers
+    uint32_t consecutive_errors;
+    bool needs_init;
+    volatile bool suspended;
+    volatile TickType_t suspended_until;
+};
+
+typedef struct {
+    owl_i2c_device_t *device;
+    uint8_t count;
+    uint8_t len[OWL_I2C_MAX_TRANSFERS];
+    uint32_t delay_us[OWL_I2C_MAX_TRANSFERS];
+    uint8_t data[OWL_I2C_MAX_WRITE_LEN]; // transfers back to back
+} i2c_write_t;
+
+static i2c_master_bus_handle_t s_bus = NULL;
+static owl_i2c_device_t s_devices[OWL_I2C_MAX_DEVICES];
+static size_t s_device_count = 0;
+static QueueHandle_t s_queue;
+
+OWL_QUEUE_DEFINE(write_queue, QUEUE_LEN, sizeof(i2c_write_t));
+OWL_TASK_DEFINE(worker_task, WORKER_STACK_SIZE, 1);
+
+OWL_METRIC_COUNTER_DEFINE(transfers_metric,
+                          "owl_i2c_transfers_total",
+                          "I2C transfers run by the scheduler");
+OWL_METRIC_COUNTER_DEFINE(dropped_metric,
+                          "owl_i2c_dropped_total",
+                          "I2C writes rejected or discarded (queue full, "
+                          "device suspended)");
+
+static bool is_suspended(const owl_i2c_device_t *device)
+{
+    return device->suspended
+        && (int32_t) (device->suspended_until - xTaskGetTickCount()) > 0;
+}
+
+static void pause_us(uint32_t delay_us)
+{
+    const uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+    if (delay_us >= tick_us) {
+        vTaskDelay((delay_us + tick_us - 1) / tick_us);
+    } else if (delay_us > 0) {
+        esp_rom_delay_us(delay_us);
+    }
+}
+
+static esp_err_t run_transfer(owl_i2c_device_t *device,
+                              const uint8_t *data,
+                              size_t len,
+                              uint32_t delay_us)
+{
+    owl_metric_inc(&transfers_metric);
+    esp_err_t ret = i2c_master_transmit(device->handle, data, len, TIMEOUT_MS);
+    if (ret == ESP_OK) {
+        device->consecutive_errors = 0;
+        device->suspended = false;
+        pause_us(delay_us);
+        return ESP_OK;
+    }
+
+    if (device->errors) {
+        owl_metric_inc(device->errors);
+    }
+    // Once suspended, a single failed probe suspends the device again
+    if (++device->consecutive_errors > device->error_budget) {
+        device->suspended_until = xTaskGetTickCount() + SUSPEND_TICKS;
+        device->suspended = true;
+        // It may have been power cycled by the time it answers again
+        device->needs_init = device->init_count > 0;
+        ESP_LOGW(TAG,
+                 "Device 0x%02X suspended after %" PRIu32 " errors (%s)",
+                 device->address,
+                 device->consecutive_errors,
+                 esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+static void run_write(const i2c_write_t *write)
+{
+    owl_i2c_device_t *device = write->device;
+
+    if (is_suspended(device)) {
+        owl_metric_inc(&dropped_metric);
+        return;
+    }
+
+    for (size_t i = 0; device->needs_init && i < device->init_count; i++) {
+        const owl_i2c_transfer_t *init = &device->init[i];
+        if (run_transfer(device, init->data, init->len, init->delay_us)
+            != ESP_OK) {
+            owl_metric_inc(&dropped_metric);
+            return;
+        }
+    }
+    device->needs_init = false;
+
+    const uint8_t *data = write->data;
+    for (size_t i = 0; i < write->count; i++) {
+        if (run_transfer(device, data, write->len[i], write->delay_us[i])
+            != ESP_OK) {
+            return;
+        }
+        data += write->len[i];
+    }
+}
+
+static void owl_i2c_task(void *arg)
+{
+    // Static, not on the stack: the worker is the only user, and a long
+    // queue would leave too little stack for the driver
+    static i2c_write_t batch[QUEUE_LEN];
+
+    while (1) {
+        // Whatever piled up since the last wakeup is run as one batch
+        size_t count = 0;
+        xQueueReceive(s_queue, &batch[count++], portMAX_DELAY);
+        while (count < QUEUE_LEN
+               && xQueueReceive(s_queue, &batch[count], 0) == pdTRUE) {
+            count++;
+        }
+
+        // Stable insertion sort by device priority, keeping the order of
+        // writes to a same device
+        for (size_t i = 1; i < count; i++) {
+            i2c_write_t write = batch[i];
+            size_t j = i;
+            while (j > 0
+                   && batch[j - 1].device->priority < write.device->priority) {
+                batch[j] = batch[j - 1];
+                j--;
+            }
+            batch[j] = write;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            owl_i2c_device_t *device = batch[i].device;
+            run_write(&batch[i]);
+            __atomic_fetch_sub(&device->pending, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void owl_i2c_init(void)
+{
+    if (s_bus) {
+        return;
+    }
+
+    i2c_master_bus_config_t bus_config = {
+        .i2c_port = I2C_NUM_0,
+        .sda_io_num = SDA_GPIO,
+        .scl_io_num = SCL_GPIO,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = 7,
+        .flags.enable_internal_pullup = true,
+    };
+    ESP_ERROR_CHECK(i2c_new_master_bus(&bus_config, &s_bus));
+
+    owl_metrics_register(&transfers_metric);
+    owl_metrics_register(&dropped_metric);
+
+    s_queue = OWL_QUEUE_CREATE(write_queue);
+    OWL_TASK_CREATE(worker_task,
+                    0,
+                    owl_i2c_task,
+                    "owl_i2c_task",
+                    NULL,
+                    WORKER_PRIORITY,
+                    tskNO_AFFINITY);
+
+    ESP_LOGI(TAG,
+             "Initialized I2C bus (SDA GPIO%d, SCL GPIO%d)",
+             SDA_GPIO,
+             SCL_GPIO);
+}
+
+esp_err_t owl_i2c_add_device(const owl_i2c_device_config_t *config,
+                             owl_i2c_device_t **device)
+{
+    if (!s_bus || s_device_count >= OWL_I2C_MAX_DEVICES) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    owl_i2c_device_t *dev = &s_devices[s_device_count];
+    i2c_device_config_t dev_config = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = config->address,
+        .scl_speed_hz = config->scl_speed_hz,
+    };
+    esp_err_t ret
+        = i2c_master_bus_add_device(s_bus, &dev_config, &dev->handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    dev->address = config->address;
+    dev->priority = config->priority;
+    dev->max_pending = config->max_pending;
+    dev->error_budget = config->error_budget;
+    dev->errors = config->errors;
+    dev->init = config->init;
+    dev->init_count = config->init_count;
+    dev->needs_init = config->init_count > 0;
+    s_device_count++;
+    *device = dev;
+    return ESP_OK;
+}
+
+esp_err_t owl_i2c_write_seq(owl_i2c_device_t *device,
+                            const owl_i2c_transfer_t *transfers,
+                            size_t count)
+{
+    if (!device || count == 0 || count > OWL_I2C_MAX_TRANSFERS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    i2c_write_t write = {
+        .device = device,
+        .count = count,
+    };
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (transfers[i].len == 0
+            || transfers[i].len > OWL_I2C_MAX_WRITE_LEN - len) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        memcpy(&write.data[len], transfers[i].data, transfers[i].len);
+        write.len[i] = transfers[i].len;
+        write.delay_us[i] = transfers[i].delay_us;
+        len += transfers[i].len;
+    }
+
+    if (is_suspended(device)) {
+        owl_metric_inc(&dropped_metric);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (__atomic_add_fetch(&device->pending, 1, __ATOMIC_RELAXED)
+        > device->max_pending) {
+        __atomic_fetch_sub(&device->pending, 1, __ATOMIC_RELAXED);
+        owl_metric_inc(&dropped_metric);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xQueueSend(s_queue, &write, 0) != pdTRUE) {
+        __atomic_fetch_sub(&device->pending, 1, __ATOMIC_RELAXED);
+        owl_metric_inc(&dropped_metric);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t owl_i2c_write(owl_i2c_device_t *device,
+                        const uint8_t *data,
+                        size_t len,
+                        uint32_t delay_us)
+{
+    if (len > OWL_I2C_MAX_WRITE_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    owl_i2c_transfer_t transfer = {
+        .data = data,
+        .len = len,
+        .delay_us = delay_us,
+    };
+    return owl_i2c_write_seq(device, &transfer, 1);
+}
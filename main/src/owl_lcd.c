@@ -1,5 +1,6 @@
 #include "owl_lcd.h"
-#include "driver/i2c_master.h"
+#include "owl_i2c.h"
+#include "owl_metrics.h"
 
 #include "esp_err.h"
 #include "esp_log.h"
@@ -22,17 +23,33 @@ static const char *TAG = "owl_lcd";
 
 #define LCD_CHAR_WIDTH 16
 
-i2c_master_bus_handle_t bus_handle;
-i2c_master_dev_handle_t backlight_handle;
-i2c_master_dev_handle_t lcd_handle;
+// Command execution times (clear and home take 1.52 ms, everything else
+// 37 us), during which the controller must not be addressed
+#define LCD_CLEAR_DELAY_US 2000
+#define LCD_COMMAND_DELAY_US 50
+
+#define LCD_PRIORITY 1
+// A couple of display updates per device: 3 backlight registers, or a write
+// for each line
+#define LCD_MAX_PENDING 8
+#define LCD_ERROR_BUDGET 3
+
+_Static_assert(2 + 1 + LCD_CHAR_WIDTH <= OWL_I2C_MAX_WRITE_LEN,
+               "An LCD line must fit in a single I2C write");
+
+static owl_i2c_device_t *s_backlight;
+static owl_i2c_device_t *s_lcd;
+
+OWL_METRIC_COUNTER_DEFINE(i2c_errors_metric,
+                          "owl_lcd_i2c_errors_total",
+                          "Failed I2C transfers to the LCD and its backlight");
 
 // backlight control
 
 static inline esp_err_t backlight_write_reg(uint8_t reg_addr, uint8_t data)
 {
     uint8_t write_buf[2] = { reg_addr, data };
-    return i2c_master_transmit(
-        backlight_handle, write_buf, sizeof(write_buf), pdMS_TO_TICKS(1000));
+    return owl_i2c_write(s_backlight, write_buf, sizeof(write_buf), 0);
 }
 
 void owl_lcd_set_backlight(owl_rgb_t color)
@@ -44,41 +61,46 @@ void owl_lcd_set_backlight(owl_rgb_t color)
 
 // lcd control
 
-static inline esp_err_t lcd_command(uint8_t cmd)
+static inline esp_err_t lcd_command(uint8_t cmd, uint32_t delay_us)
 {
     uint8_t write_buf[] = { 0x80, cmd };
-    return i2c_master_transmit(
-        lcd_handle, write_buf, sizeof(write_buf), pdMS_TO_TICKS(1000));
-}
-
-static inline esp_err_t lcd_char(uint8_t c)
-{
-    uint8_t write_buf[] = { 0x40, c };
-    return i2c_master_transmit(
-        lcd_handle, write_buf, sizeof(write_buf), pdMS_TO_TICKS(1000));
+    return owl_i2c_write(s_lcd, write_buf, sizeof(write_buf), delay_us);
 }
 
 esp_err_t owl_lcd_clear()
 {
-    esp_err_t res = lcd_command(LCD_CMD_CLEAR);
-    vTaskDelay(pdMS_TO_TICKS(2));
-    return res;
+    return lcd_command(LCD_CMD_CLEAR, LCD_CLEAR_DELAY_US);
 }
 
+// A line is queued as a single write, so the cursor never moves without the
+// text following: the DDRAM address, then the text in one transfer (with the
+// continuation bit cleared (0x40), every byte following the control byte is
+// character data)
 esp_err_t owl_lcd_write(uint8_t line, const char *s)
 {
-    esp_err_t res = ESP_OK;
-    res |= lcd_command(LCD_CMD_SET_DDRAM_ADDR
-                       | (line & 1 ? LCD_ADDR_LINE1 : LCD_ADDR_LINE0));
-    vTaskDelay(pdMS_TO_TICKS(2));
-    size_t len = strlen(s);
-    for (size_t i = 0; i < LCD_CHAR_WIDTH; i++) {
-        if (i < len)
-            res |= lcd_char(s[i]);
-        else
-            res |= lcd_char(' ');
-    }
-    return res;
+    uint8_t addr = line & 1 ? LCD_ADDR_LINE1 : LCD_ADDR_LINE0;
+    uint8_t addr_buf[] = { 0x80, LCD_CMD_SET_DDRAM_ADDR | addr };
+
+    uint8_t text_buf[1 + LCD_CHAR_WIDTH];
+    text_buf[0] = 0x40;
+    size_t len = strnlen(s, LCD_CHAR_WIDTH);
+    memcpy(&text_buf[1], s, len);
+    memset(&text_buf[1 + len], ' ', LCD_CHAR_WIDTH - len);
+
+    const owl_i2c_transfer_t transfers[] = {
+        {
+            .data = addr_buf,
+            .len = sizeof(addr_buf),
+            .delay_us = LCD_COMMAND_DELAY_US,
+        },
+        {
+            .data = text_buf,
+            .len = sizeof(text_buf),
+            .delay_us = LCD_COMMAND_DELAY_US,
+        },
+    };
+    return owl_i2c_write_seq(
+        s_lcd, transfers, sizeof(transfers) / sizeof(transfers[0]));
 }
 
 #define LCD_PFX_FUNCTION 0x20
@@ -98,49 +120,50 @@ esp_err_t owl_lcd_write(uint8_t line, const char *s)
 #define LCD_SET_SHIFT 0x01
 #define LCD_SET_NO_SHIFT 0x00
 
-void owl_lcd_init()
-{
-    i2c_master_bus_config_t bus_config = {
-        .i2c_port = I2C_NUM_0,
-        .sda_io_num = 13,
-        .scl_io_num = 14,
-        .clk_source = I2C_CLK_SRC_DEFAULT,
-        .glitch_ignore_cnt = 7,
-        .flags.enable_internal_pullup = true,
-    };
-    ESP_ERROR_CHECK(i2c_new_master_bus(&bus_config, &bus_handle));
+#define LCD_INIT_COMMAND(cmd, delay)                                           \
+    {                                                                          \
+        .data = (const uint8_t[]) { 0x80, (cmd) },                             \
+        .len = 2,                                                              \
+        .delay_us = (delay),                                                   \
+    }
 
-    i2c_device_config_t backlight_config = {
-        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
-        .device_address = 0x2D,
-        .scl_speed_hz = 100000,
-    };
+// Replayed by the I2C scheduler before the first write, and whenever the LCD
+// answers again after being suspended, since it may have been power cycled
+static const owl_i2c_transfer_t lcd_init_sequence[] = {
+    LCD_INIT_COMMAND(LCD_PFX_FUNCTION | LCD_SET_2LINE | LCD_SET_DISP_ON,
+                     LCD_COMMAND_DELAY_US),
+    LCD_INIT_COMMAND(LCD_PFX_DISP | LCD_SET_DISP_ON | LCD_SET_CURSOR_OFF
+                         | LCD_SET_BLINK_OFF,
+                     LCD_COMMAND_DELAY_US),
+    LCD_INIT_COMMAND(LCD_CMD_CLEAR, LCD_CLEAR_DELAY_US),
+    LCD_INIT_COMMAND(LCD_PFX_ENTRY_MODE | LCD_SET_MOVE_RIGHT | LCD_SET_SHIFT,
+                     LCD_COMMAND_DELAY_US),
+};
 
-    ESP_ERROR_CHECK(i2c_master_bus_add_device(
-        bus_handle, &backlight_config, &backlight_handle));
+void owl_lcd_init()
+{
+    owl_metrics_register(&i2c_errors_metric);
+    owl_i2c_init();
 
-    i2c_device_config_t disp_config = {
-        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
-        .device_address = 0x3E,
+    owl_i2c_device_config_t backlight_config = {
+        .address = 0x2D,
         .scl_speed_hz = 100000,
+        .priority = LCD_PRIORITY,
+        .max_pending = LCD_MAX_PENDING,
+        .error_budget = LCD_ERROR_BUDGET,
+        .errors = &i2c_errors_metric,
     };
+    ESP_ERROR_CHECK(owl_i2c_add_device(&backlight_config, &s_backlight));
 
-    ESP_ERROR_CHECK(
-        i2c_master_bus_add_device(bus_handle, &disp_config, &lcd_handle));
+    // A missing or faulty LCD only shows up in owl_lcd_i2c_errors_total
+    owl_i2c_device_config_t disp_config = backlight_config;
+    disp_config.address = 0x3E;
+    disp_config.init = lcd_init_sequence;
+    disp_config.init_count
+        = sizeof(lcd_init_sequence) / sizeof(lcd_init_sequence[0]);
+    ESP_ERROR_CHECK(owl_i2c_add_device(&disp_config, &s_lcd));
 
     vTaskDelay(pdMS_TO_TICKS(50)); // wait after power up
 
-    ESP_ERROR_CHECK(
-        lcd_command(LCD_PFX_FUNCTION | LCD_SET_2LINE | LCD_SET_DISP_ON));
-    vTaskDelay(pdMS_TO_TICKS(1));
-    ESP_ERROR_CHECK(lcd_command(LCD_PFX_DISP | LCD_SET_DISP_ON
-                                | LCD_SET_CURSOR_OFF | LCD_SET_BLINK_OFF));
-    vTaskDelay(pdMS_TO_TICKS(1));
-    ESP_ERROR_CHECK(lcd_command(LCD_CMD_CLEAR));
-    vTaskDelay(pdMS_TO_TICKS(2));
-    ESP_ERROR_CHECK(
-        lcd_command(LCD_PFX_ENTRY_MODE | LCD_SET_MOVE_RIGHT | LCD_SET_SHIFT));
-    vTaskDelay(pdMS_TO_TICKS(10));
-
     ESP_LOGI(TAG, "Initialized LCD display");
 }
@@ -1,4 +1,5 @@
 #include "owl_led.h"
+#include "owl_static.h"
 #include "esp_log.h"
 
 #include "driver/gpio.h"
@@ -10,8 +11,14 @@ static const char *TAG = "owl_led";
 
 #define BOARD_LED_GPIO CONFIG_OWL_LED_GPIO
 
+#define TASK_STACK_SIZE 4096
+#define TASK_PRIORITY 5
+
 QueueHandle_t owl_led_command_queue;
 
+OWL_QUEUE_DEFINE(led_queue, 4, sizeof(int));
+OWL_TASK_DEFINE(led_task, TASK_STACK_SIZE, 1);
+
 // Send either one of the variants, or a positive integer specifying blink
 // interval (in ms)
 typedef enum {
@@ -71,12 +78,18 @@ static void owl_led_task(void *arg)
 
 void owl_led_init(void)
 {
-    owl_led_command_queue = xQueueCreate(4, sizeof(int));
+    owl_led_command_queue = OWL_QUEUE_CREATE(led_queue);
     gpio_reset_pin(BOARD_LED_GPIO);
     gpio_set_direction(BOARD_LED_GPIO, GPIO_MODE_OUTPUT);
     ESP_LOGI(TAG, "Initialized board led (GPIO%d)", BOARD_LED_GPIO);
     led_off();
-    xTaskCreate(owl_led_task, "owl_led_task", 4096, NULL, 5, NULL);
+    OWL_TASK_CREATE(led_task,
+                    0,
+                    owl_led_task,
+                    "owl_led_task",
+                    NULL,
+                    TASK_PRIORITY,
+                    tskNO_AFFINITY);
 }
 
 void owl_led_on(void)
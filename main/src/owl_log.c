@@ -0,0 +1,488 @@
+#include "owl_log.h"
+#include "owl_static.h"
+
+#ifdef CONFIG_OWL_LOG_DEFERRED
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "owl_log";
+
+#define RING_SIZE CONFIG_OWL_LOG_RING_SIZE
+#define RECORD_MAX_LEN 160
+#define STRING_MAX_LEN 48
+#define LINE_MAX_LEN 256
+#define FORMAT_INTERVAL_MS 50
+#define TASK_STACK_SIZE 3072
+#define TASK_PRIORITY 1
+
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0,
+               "Log ring size must be a power of two");
+// Eviction only terminates if the largest record fits next to another one
+_Static_assert(RING_SIZE >= 2 * RECORD_MAX_LEN,
+               "Log ring must hold at least two records of the maximum size");
+
+// Records are variable length and padded to 4 bytes. Writers overwrite the
+// oldest records when the ring is full, pushing the formatter's cursor along
+// (tail <= cursor <= head, all free-running).
+static uint8_t s_ring[RING_SIZE] __attribute__((aligned(4)));
+static uint32_t s_head = 0;
+static uint32_t s_tail = 0;
+static uint32_t s_cursor = 0;
+static uint32_t s_lost = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+OWL_TASK_DEFINE(log_task, TASK_STACK_SIZE, 1);
+
+typedef enum {
+    ARG_NONE,
+    ARG_INT,
+    ARG_LONG,
+    ARG_INT64,
+    ARG_SIZE,
+    ARG_POINTER,
+    ARG_DOUBLE,
+    ARG_STRING,
+} arg_type_t;
+
+typedef struct {
+    size_t len; // from '%' to the conversion, inclusive
+    arg_type_t type;
+    uint8_t stars; // '*' width / precision, passed as extra int arguments
+    char conversion;
+} spec_t;
+
+// Parses the conversion specification starting at `p` ('%')
+static void parse_spec(const char *p, spec_t *spec)
+{
+    const char *s = p + 1;
+    int longs = 0;
+    bool size = false;
+
+    spec->stars = 0;
+    while (*s && strchr("-+ #0", *s)) {
+        s++;
+    }
+    if (*s == '*') {
+        spec->stars++;
+        s++;
+    }
+    while (isdigit((unsigned char) *s)) {
+        s++;
+    }
+    if (*s == '.') {
+        s++;
+        if (*s == '*') {
+            spec->stars++;
+            s++;
+        }
+        while (isdigit((unsigned char) *s)) {
+            s++;
+        }
+    }
+    while (*s && strchr("hlzjtL", *s)) {
+        longs += *s == 'l';
+        longs += (*s == 'j') * 2;
+        size |= *s == 'z' || *s == 't';
+        s++;
+    }
+
+    spec->conversion = *s;
+    switch (*s) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+    case 'c':
+        spec->type = longs >= 2 ? ARG_INT64
+                   : longs == 1 ? ARG_LONG
+                   : size       ? ARG_SIZE
+                                : ARG_INT;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->type = ARG_DOUBLE;
+        break;
+    case 'p':
+        spec->type = ARG_POINTER;
+        break;
+    case 's':
+        spec->type = ARG_STRING;
+        break;
+    default:
+        spec->type = ARG_NONE;
+    }
+    if (*s) {
+        s++;
+    }
+    spec->len = s - p;
+}
+
+static void ring_write(uint32_t pos, const void *data, size_t len)
+{
+    size_t offset = pos & (RING_SIZE - 1);
+    size_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+    memcpy(&s_ring[offset], data, first);
+    memcpy(s_ring, (const uint8_t *) data + first, len - first);
+}
+
+static void ring_read(uint32_t pos, void *data, size_t len)
+{
+    size_t offset = pos & (RING_SIZE - 1);
+    size_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+    memcpy(data, &s_ring[offset], first);
+    memcpy((uint8_t *) data + first, s_ring, len - first);
+}
+
+static uint16_t ring_record_len(uint32_t pos)
+{
+    uint16_t len;
+    ring_read(pos, &len, sizeof(len));
+    return len;
+}
+
+#define PUT_ARG(type, value)                                                   \
+    do {                                                                       \
+        type v_ = (value);                                                     \
+        if (len + sizeof(v_) > RECORD_MAX_LEN) {                               \
+            goto commit;                                                       \
+        }                                                                      \
+        memcpy(&record[len], &v_, sizeof(v_));                                 \
+        len += sizeof(v_);                                                     \
+    } while (0)
+
+void owl_log_write(esp_log_level_t level,
+                   const char *tag,
+                   const char *format,
+                   ...)
+{
+    uint8_t record[RECORD_MAX_LEN] __attribute__((aligned(4)));
+    size_t len = sizeof(owl_log_record_t);
+
+    va_list ap;
+    va_start(ap, format);
+    for (const char *p = strchr(format, '%'); p; p = strchr(p, '%')) {
+        spec_t spec;
+        parse_spec(p, &spec);
+        p += spec.len;
+
+        for (size_t i = 0; i < spec.stars; i++) {
+            PUT_ARG(int, va_arg(ap, int));
+        }
+        switch (spec.type) {
+        case ARG_INT:
+            PUT_ARG(int, va_arg(ap, int));
+            break;
+        case ARG_LONG:
+            PUT_ARG(long, va_arg(ap, long));
+            break;
+        case ARG_INT64:
+            PUT_ARG(long long, va_arg(ap, long long));
+            break;
+        case ARG_SIZE:
+            PUT_ARG(size_t, va_arg(ap, size_t));
+            break;
+        case ARG_POINTER:
+            PUT_ARG(void *, va_arg(ap, void *));
+            break;
+        case ARG_DOUBLE:
+            PUT_ARG(double, va_arg(ap, double));
+            break;
+        case ARG_STRING: {
+            const char *s = va_arg(ap, const char *);
+            if (!s) {
+                s = "(null)";
+            }
+            size_t n = strnlen(s, STRING_MAX_LEN);
+            if (len + 1 + n > RECORD_MAX_LEN) {
+                goto commit;
+            }
+            record[len++] = n;
+            memcpy(&record[len], s, n);
+            len += n;
+            break;
+        }
+        case ARG_NONE:
+            break;
+        }
+    }
+
+commit:
+    va_end(ap);
+
+    size_t padded_len = (len + 3) & ~(size_t) 3;
+    memset(&record[len], 0, padded_len - len);
+    owl_log_record_t *header = (owl_log_record_t *) record;
+    header->len = padded_len;
+    header->level = level;
+    header->padding = padded_len - len;
+    len = padded_len;
+    header->timestamp_ms = esp_log_timestamp();
+    header->tag = tag;
+    header->format = format;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    while (s_head + len - s_tail > RING_SIZE) {
+        uint16_t oldest_len = ring_record_len(s_tail);
+        if (s_cursor == s_tail) {
+            s_cursor += oldest_len;
+            s_lost++;
+        }
+        s_tail += oldest_len;
+    }
+    ring_write(s_head, record, len);
+    s_head += len;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+static char level_char(uint8_t level)
+{
+    static const char chars[] = { 'N', 'E', 'W', 'I', 'D', 'V' };
+    return level < sizeof(chars) ? chars[level] : '?';
+}
+
+#define TAKE_ARG(type, var)                                                    \
+    type var;                                                                  \
+    if (arg + sizeof(var) > end) {                                             \
+        goto truncated;                                                        \
+    }                                                                          \
+    memcpy(&var, arg, sizeof(var));                                            \
+    arg += sizeof(var)
+
+#define FORMAT_ARG(value)                                                      \
+    (spec.stars == 0   ? snprintf(line + pos, size - pos, fmt, value)          \
+     : spec.stars == 1 ? snprintf(line + pos, size - pos, fmt, stars[0], value) \
+                       : snprintf(line + pos,                                  \
+                                  size - pos,                                  \
+                                  fmt,                                         \
+                                  stars[0],                                    \
+                                  stars[1],                                    \
+                                  value))
+
+// Formats one record into `line` (ESP_LOG style, newline terminated)
+static void format_record(const uint8_t *record, char *line, size_t size)
+{
+    const owl_log_record_t *header = (const owl_log_record_t *) record;
+    const uint8_t *arg = record + sizeof(owl_log_record_t);
+    const uint8_t *end = record + header->len - header->padding;
+
+    int pos = snprintf(line,
+                       size - 1,
+                       "%c (%" PRIu32 ") %s: ",
+                       level_char(header->level),
+                       header->timestamp_ms,
+                       header->tag);
+    // Room is kept for the newline whatever the length of the tag
+    if (pos < 0) {
+        pos = 0;
+    } else if (pos > (int) size - 2) {
+        pos = size - 2;
+    }
+
+    const char *p = header->format;
+    while (*p && pos < (int) size - 2) {
+        const char *percent = strchr(p, '%');
+        size_t literal = percent ? (size_t) (percent - p) : strlen(p);
+        if (literal > size - 2 - pos) {
+            literal = size - 2 - pos;
+        }
+        memcpy(line + pos, p, literal);
+        pos += literal;
+        if (!percent) {
+            break;
+        }
+
+        spec_t spec;
+        parse_spec(percent, &spec);
+        p = percent + spec.len;
+
+        // Skipping the conversion would shift every later argument
+        char fmt[16];
+        if (spec.len >= sizeof(fmt)) {
+            goto truncated;
+        }
+        memcpy(fmt, percent, spec.len);
+        fmt[spec.len] = '\0';
+
+        int stars[2] = { 0 };
+        for (size_t i = 0; i < spec.stars; i++) {
+            TAKE_ARG(int, star);
+            stars[i] = star;
+        }
+
+        int written = 0;
+        switch (spec.type) {
+        case ARG_INT: {
+            TAKE_ARG(int, value);
+            written = FORMAT_ARG(value);
+            break;
+        }
+        case ARG_LONG: {
+            TAKE_ARG(long, value);
+            written = FORMAT_ARG(value);
+            break;
+        }
+        case ARG_INT64: {
+            TAKE_ARG(long long, value);
+            written = FORMAT_ARG(value);
+            break;
+        }
+        case ARG_SIZE: {
+            TAKE_ARG(size_t, value);
+            written = FORMAT_ARG(value);
+            break;
+        }
+        case ARG_POINTER: {
+            TAKE_ARG(void *, value);
+            written = FORMAT_ARG(value);
+            break;
+        }
+        case ARG_DOUBLE: {
+            TAKE_ARG(double, value);
+            written = FORMAT_ARG(value);
+            break;
+        }
+        case ARG_STRING: {
+            char s[STRING_MAX_LEN + 1];
+            if (arg >= end || arg + 1 + *arg > end) {
+                goto truncated;
+            }
+            memcpy(s, arg + 1, *arg);
+            s[*arg] = '\0';
+            arg += 1 + *arg;
+            written = FORMAT_ARG(s);
+            break;
+        }
+        case ARG_NONE:
+            if (spec.conversion == '%') {
+                line[pos] = '%';
+                written = 1;
+            }
+            break;
+        }
+        pos += written;
+        if (pos > (int) size - 2) {
+            pos = size - 2;
+        }
+    }
+    goto done;
+
+truncated:
+    pos += snprintf(line + pos, size - 1 - pos, "...");
+    if (pos > (int) size - 2) {
+        pos = size - 2;
+    }
+done:
+    line[pos++] = '\n';
+    line[pos] = '\0';
+}
+
+static void owl_log_task(void *arg)
+{
+    uint8_t record[RECORD_MAX_LEN] __attribute__((aligned(4)));
+    char line[LINE_MAX_LEN];
+    uint32_t reported_lost = 0;
+
+    while (1) {
+        bool pending = false;
+        uint32_t lost;
+
+        portENTER_CRITICAL(&s_lock);
+        if (s_cursor != s_head) {
+            uint16_t len = ring_record_len(s_cursor);
+            ring_read(s_cursor, record, len);
+            s_cursor += len;
+            pending = true;
+        }
+        lost = s_lost;
+        portEXIT_CRITICAL(&s_lock);
+
+        if (lost != reported_lost) {
+            ESP_LOGW(TAG,
+                     "%" PRIu32 " records overwritten before being formatted",
+                     lost - reported_lost);
+            reported_lost = lost;
+        }
+        if (!pending) {
+            vTaskDelay(pdMS_TO_TICKS(FORMAT_INTERVAL_MS));
+            continue;
+        }
+
+        const owl_log_record_t *header = (const owl_log_record_t *) record;
+        format_record(record, line, sizeof(line));
+        esp_log_write(header->level, header->tag, "%s", line);
+    }
+}
+
+void owl_log_init(void)
+{
+    OWL_TASK_CREATE(log_task,
+                    0,
+                    owl_log_task,
+                    "owl_log_task",
+                    NULL,
+                    TASK_PRIORITY,
+                    tskNO_AFFINITY);
+    ESP_LOGI(TAG, "Deferred logging enabled (%d byte ring)", RING_SIZE);
+}
+
+size_t owl_log_dump(uint8_t *buff, size_t size)
+{
+    owl_log_dump_header_t header = {
+        .magic = OWL_LOG_DUMP_MAGIC,
+    };
+    if (size < sizeof(header)) {
+        return 0;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    header.lost = s_lost;
+    // Skip the oldest records if they don't all fit
+    uint32_t start = s_tail;
+    while (s_head - start > size - sizeof(header)) {
+        start += ring_record_len(start);
+    }
+    size_t len = s_head - start;
+    ring_read(start, buff + sizeof(header), len);
+    portEXIT_CRITICAL(&s_lock);
+
+    memcpy(buff, &header, sizeof(header));
+    return sizeof(header) + len;
+}
+
+void owl_log_format_dump(const uint8_t *dump,
+                         size_t len,
+                         owl_log_emit_t emit,
+                         void *ctx)
+{
+    char line[LINE_MAX_LEN];
+
+    for (size_t pos = sizeof(owl_log_dump_header_t);
+         pos + sizeof(owl_log_record_t) <= len;) {
+        const owl_log_record_t *header
+            = (const owl_log_record_t *) (dump + pos);
+        if (header->len < sizeof(owl_log_record_t) || pos + header->len > len) {
+            break;
+        }
+        format_record(dump + pos, line, sizeof(line));
+        emit(line, ctx);
+        pos += header->len;
+    }
+}
+
+#endif
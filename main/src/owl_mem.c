@@ -0,0 +1,86 @@
+#include "owl_mem.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+
+// Prepended to every tagged allocation, keeps the payload max-aligned
+typedef union {
+    size_t size;
+    max_align_t align;
+} alloc_header_t;
+
+static owl_mem_stats_t s_stats[OWL_MEM_TAG_COUNT];
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const tag_names[OWL_MEM_TAG_COUNT] = {
+    [OWL_MEM_HTTP] = "http",
+    [OWL_MEM_WIFI] = "wifi",
+    [OWL_MEM_ONEWIRE] = "onewire",
+    [OWL_MEM_DISPLAY] = "display",
+    [OWL_MEM_MQTT] = "mqtt",
+};
+
+static void account(owl_mem_tag_t tag, size_t alloc_size, size_t free_size)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    owl_mem_stats_t *stats = &s_stats[tag];
+    stats->current += alloc_size;
+    stats->current -= free_size < stats->current ? free_size : stats->current;
+    if (stats->current > stats->peak) {
+        stats->peak = stats->current;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+void *owl_malloc(owl_mem_tag_t tag, size_t size)
+{
+    alloc_header_t *header = malloc(sizeof(alloc_header_t) + size);
+    if (!header) {
+        return NULL;
+    }
+
+    header->size = size;
+    account(tag, size, 0);
+    return header + 1;
+}
+
+void owl_free(owl_mem_tag_t tag, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    alloc_header_t *header = (alloc_header_t *) ptr - 1;
+    account(tag, 0, header->size);
+    free(header);
+}
+
+size_t owl_mem_track_begin(void)
+{
+    return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+}
+
+void owl_mem_track_end(owl_mem_tag_t tag, size_t begin)
+{
+    size_t end = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (begin > end) {
+        account(tag, begin - end, 0);
+    } else {
+        account(tag, 0, end - begin);
+    }
+}
+
+const char *owl_mem_tag_name(owl_mem_tag_t tag)
+{
+    return tag < OWL_MEM_TAG_COUNT ? tag_names[tag] : "unknown";
+}
+
+void owl_mem_stats(owl_mem_tag_t tag, owl_mem_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats[tag];
+    portEXIT_CRITICAL(&s_stats_lock);
+}
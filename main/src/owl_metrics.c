@@ -0,0 +1,136 @@
+#include "owl_metrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define LINE_MAX_LEN 192
+
+// Registered metrics, most recent first. Only ever pushed to, so scrapes can
+// walk it while modules register.
+static owl_metric_t *s_metrics = NULL;
+
+static const char *const type_names[] = {
+    [OWL_METRIC_COUNTER] = "counter",
+    [OWL_METRIC_GAUGE] = "gauge",
+    [OWL_METRIC_HISTOGRAM] = "histogram",
+};
+
+void owl_metrics_register(owl_metric_t *metric)
+{
+    if (__atomic_exchange_n(&metric->registered, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    owl_metric_t *head = __atomic_load_n(&s_metrics, __ATOMIC_ACQUIRE);
+    do {
+        metric->next = head;
+    } while (!__atomic_compare_exchange_n(&s_metrics,
+                                          &head,
+                                          metric,
+                                          true,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_ACQUIRE));
+}
+
+// Reads the sum of a histogram written concurrently by its owner task
+static uint64_t histogram_sum(const owl_metric_t *metric)
+{
+    uint32_t seq, lo, hi;
+
+    while (1) {
+        seq = __atomic_load_n(&metric->sum_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            // Let the owner finish, should it run below the scraper
+            vTaskDelay(1);
+            continue;
+        }
+        lo = __atomic_load_n(&metric->sum_lo, __ATOMIC_RELAXED);
+        hi = __atomic_load_n(&metric->sum_hi, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&metric->sum_seq, __ATOMIC_RELAXED) == seq) {
+            return (uint64_t) hi << 32 | lo;
+        }
+    }
+}
+
+static void format_histogram(const owl_metric_t *metric,
+                             owl_metrics_emit_t emit,
+                             void *ctx)
+{
+    char line[LINE_MAX_LEN];
+    uint32_t cumulative = 0;
+
+    for (size_t i = 0; i <= metric->bucket_count; i++) {
+        cumulative += __atomic_load_n(&metric->buckets[i], __ATOMIC_RELAXED);
+        if (i < metric->bucket_count) {
+            snprintf(line,
+                     sizeof(line),
+                     "%s_bucket{le=\"%" PRIu32 "\"} %" PRIu32 "\n",
+                     metric->name,
+                     metric->bounds[i],
+                     cumulative);
+        } else {
+            snprintf(line,
+                     sizeof(line),
+                     "%s_bucket{le=\"+Inf\"} %" PRIu32 "\n",
+                     metric->name,
+                     cumulative);
+        }
+        emit(line, ctx);
+    }
+
+    snprintf(line,
+             sizeof(line),
+             "%s_sum %" PRIu64 "\n%s_count %" PRIu32 "\n",
+             metric->name,
+             histogram_sum(metric),
+             metric->name,
+             cumulative);
+    emit(line, ctx);
+}
+
+void owl_metrics_format(owl_metrics_emit_t emit, void *ctx)
+{
+    char line[LINE_MAX_LEN];
+
+    for (const owl_metric_t *metric
+         = __atomic_load_n(&s_metrics, __ATOMIC_ACQUIRE);
+         metric;
+         metric = metric->next) {
+        snprintf(line,
+                 sizeof(line),
+                 "# HELP %s %s\n# TYPE %s %s\n",
+                 metric->name,
+                 metric->help,
+                 metric->name,
+                 type_names[metric->type]);
+        emit(line, ctx);
+
+        switch (metric->type) {
+        case OWL_METRIC_COUNTER:
+            snprintf(line,
+                     sizeof(line),
+                     "%s %" PRIu32 "\n",
+                     metric->name,
+                     __atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+            emit(line, ctx);
+            break;
+        case OWL_METRIC_GAUGE:
+            snprintf(line,
+                     sizeof(line),
+                     "%s %" PRId32 "\n",
+                     metric->name,
+                     metric->read ? metric->read()
+                                  : (int32_t) __atomic_load_n(
+                                        &metric->value, __ATOMIC_RELAXED));
+            emit(line, ctx);
+            break;
+        case OWL_METRIC_HISTOGRAM:
+            format_histogram(metric, emit, ctx);
+            break;
+        }
+    }
+}
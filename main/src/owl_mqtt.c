@@ -0,0 +1,281 @@
+#include "owl_mqtt.h"
+
+#ifdef CONFIG_OWL_MQTT
+
+#include "owl_mem.h"
+#include "owl_static.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mqtt_client.h"
+
+static const char *TAG = "owl_mqtt";
+
+#define BROKER_URI CONFIG_OWL_MQTT_BROKER_URI
+#define TOPIC CONFIG_OWL_MQTT_TOPIC
+#define QOS CONFIG_OWL_MQTT_QOS
+#define BATCH_RECORDS CONFIG_OWL_MQTT_BATCH_RECORDS
+#define BATCH_WINDOW_US (CONFIG_OWL_MQTT_BATCH_WINDOW_MS * 1000LL)
+#define RAM_RECORDS CONFIG_OWL_MQTT_RAM_RECORDS
+#define DRAIN_INTERVAL_MS CONFIG_OWL_MQTT_DRAIN_INTERVAL_MS
+
+#define RETRY_INTERVAL_MS 1000
+#define TASK_STACK_SIZE 4096
+#define TASK_PRIORITY 2
+
+// {"seq":4294967295,"id":4294967295,"ts":-9223372036854775808,
+//  "rom":"0123456789ABCDEF"},
+#define RECORD_JSON_LEN 96
+#define PAYLOAD_LEN (BATCH_RECORDS * RECORD_JSON_LEN + 64)
+
+static esp_mqtt_client_handle_t s_client;
+static TaskHandle_t s_task;
+static volatile bool s_connected = false;
+static char s_device[13];
+
+// RAM buffer, filled by the pipeline
+static QueueHandle_t s_queue;
+OWL_QUEUE_DEFINE(ram_queue, RAM_RECORDS, sizeof(owl_scanlog_record_t));
+OWL_TASK_DEFINE(mqtt_task, TASK_STACK_SIZE, 1);
+static uint32_t s_dropped = 0;
+
+// Once the RAM buffer overflows, records are published from the scan log
+// until the backlog has caught up with the pipeline
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_backlog_seq = OWL_SCANLOG_SEQ_NONE; // next seq to drain
+static uint32_t s_appended_seq = 0; // seq following the last one seen
+
+static char s_payload[PAYLOAD_LEN];
+
+static void mqtt_event_handler(void *arg,
+                               esp_event_base_t event_base,
+                               int32_t event_id,
+                               void *event_data)
+{
+    switch ((esp_mqtt_event_id_t) event_id) {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Connected to %s", BROKER_URI);
+        s_connected = true;
+        xTaskNotifyGive(s_task);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGW(TAG, "Disconnected");
+        s_connected = false;
+        break;
+    default:
+        break;
+    }
+}
+
+static bool publish_batch(const owl_scanlog_record_t *batch, size_t len)
+{
+    int pos = snprintf(
+        s_payload, sizeof(s_payload), "{\"device\":\"%s\",\"records\":[", s_device);
+
+    for (size_t i = 0; i < len; i++) {
+        const owl_scanlog_record_t *record = &batch[i];
+        char seq[12] = "null";
+        if (record->seq != OWL_SCANLOG_SEQ_NONE) {
+            snprintf(seq, sizeof(seq), "%" PRIu32, record->seq);
+        }
+        pos += snprintf(s_payload + pos,
+                        sizeof(s_payload) - pos,
+                        "%s{\"seq\":%s,\"id\":%" PRIu32 ",\"ts\":%" PRId64
+                        ",\"rom\":\"%016" PRIX64 "\"}",
+                        i ? "," : "",
+                        seq,
+                        record->id,
+                        record->timestamp_us,
+                        record->rom);
+    }
+    pos += snprintf(s_payload + pos, sizeof(s_payload) - pos, "]}");
+
+    if (!s_connected
+        || esp_mqtt_client_publish(s_client, TOPIC, s_payload, pos, QOS, 0)
+               < 0) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Published %zu records", len);
+    return true;
+}
+
+// Publishes the next batch of the backlog from the scan log, returns false if
+// there was nothing to publish yet
+static bool drain_backlog(void)
+{
+    owl_scanlog_record_t batch[BATCH_RECORDS];
+    size_t len = 0;
+
+    uint32_t first_seq, flushed_seq;
+    owl_scanlog_range(&first_seq, &flushed_seq);
+
+    uint32_t seq = s_backlog_seq;
+    if ((int32_t) (seq - first_seq) < 0) {
+        ESP_LOGW(TAG,
+                 "Backlog records %" PRIu32 "..%" PRIu32 " already compacted",
+                 seq,
+                 first_seq - 1);
+        seq = first_seq;
+    }
+    for (; seq != flushed_seq && len < BATCH_RECORDS; seq++) {
+        if (owl_scanlog_read(seq, &batch[len]) == ESP_OK) {
+            len++;
+        }
+    }
+
+    if (len > 0 && !publish_batch(batch, len)) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    s_backlog_seq = seq == s_appended_seq ? OWL_SCANLOG_SEQ_NONE : seq;
+    portEXIT_CRITICAL(&s_lock);
+    if (s_backlog_seq == OWL_SCANLOG_SEQ_NONE) {
+        ESP_LOGI(TAG, "Backlog drained");
+    }
+    return len > 0;
+}
+
+static void owl_mqtt_task(void *arg)
+{
+    owl_scanlog_record_t batch[BATCH_RECORDS];
+    size_t len = 0;
+    int64_t window_end_us = 0;
+
+    while (1) {
+        if (!s_connected) {
+            // Records pile up in the RAM buffer, then in the scan log
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        bool backlog = s_backlog_seq != OWL_SCANLOG_SEQ_NONE;
+
+        // Collect a batch: up to BATCH_RECORDS, within one window
+        while (len < BATCH_RECORDS) {
+            TickType_t timeout;
+            if (len == 0) {
+                timeout = backlog ? 0 : portMAX_DELAY;
+            } else {
+                int64_t remaining_us = window_end_us - esp_timer_get_time();
+                if (remaining_us <= 0) {
+                    break;
+                }
+                timeout = pdMS_TO_TICKS(remaining_us / 1000) + 1;
+            }
+            if (!xQueueReceive(s_queue, &batch[len], timeout)) {
+                break;
+            }
+            if (len++ == 0) {
+                window_end_us = esp_timer_get_time() + BATCH_WINDOW_US;
+            }
+        }
+
+        if (len > 0) {
+            if (!publish_batch(batch, len)) {
+                // Keep the batch and retry
+                vTaskDelay(pdMS_TO_TICKS(RETRY_INTERVAL_MS));
+                continue;
+            }
+            len = 0;
+            // Drain what accumulated offline at a limited rate
+            if (uxQueueMessagesWaiting(s_queue) >= BATCH_RECORDS) {
+                vTaskDelay(pdMS_TO_TICKS(DRAIN_INTERVAL_MS));
+            }
+        } else if (backlog) {
+            drain_backlog();
+            vTaskDelay(pdMS_TO_TICKS(DRAIN_INTERVAL_MS));
+        }
+    }
+}
+
+void owl_mqtt_init(void)
+{
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(s_device,
+             sizeof(s_device),
+             "%02x%02x%02x%02x%02x%02x",
+             mac[0],
+             mac[1],
+             mac[2],
+             mac[3],
+             mac[4],
+             mac[5]);
+
+    static char client_id[20];
+    snprintf(client_id, sizeof(client_id), "owl-%s", s_device);
+
+    s_queue = OWL_QUEUE_CREATE(ram_queue);
+    s_task = OWL_TASK_CREATE(mqtt_task,
+                             0,
+                             owl_mqtt_task,
+                             "owl_mqtt_task",
+                             NULL,
+                             TASK_PRIORITY,
+                             tskNO_AFFINITY);
+
+    size_t mem = owl_mem_track_begin();
+    const esp_mqtt_client_config_t config = {
+        .broker.address.uri = BROKER_URI,
+        .credentials.client_id = client_id,
+        .buffer.size = 1024,
+        .buffer.out_size = PAYLOAD_LEN,
+    };
+    s_client = esp_mqtt_client_init(&config);
+    ESP_ERROR_CHECK(esp_mqtt_client_register_event(
+        s_client, MQTT_EVENT_ANY, mqtt_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_mqtt_client_start(s_client));
+    owl_mem_track_end(OWL_MEM_MQTT, mem);
+
+    ESP_LOGI(TAG,
+             "Initialized MQTT (%s, topic %s, QoS %d)",
+             BROKER_URI,
+             TOPIC,
+             QOS);
+}
+
+void owl_mqtt_publish(const owl_scanlog_record_t *records, size_t count)
+{
+    if (!s_queue) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const owl_scanlog_record_t *record = &records[i];
+        bool logged = record->seq != OWL_SCANLOG_SEQ_NONE;
+
+        portENTER_CRITICAL(&s_lock);
+        if (logged) {
+            s_appended_seq = record->seq + 1;
+        }
+        bool backlog = s_backlog_seq != OWL_SCANLOG_SEQ_NONE;
+        portEXIT_CRITICAL(&s_lock);
+
+        // Keep ordering, the record gets published along with the backlog
+        if (logged && backlog) {
+            continue;
+        }
+
+        if (xQueueSend(s_queue, record, 0) != pdTRUE) {
+            if (logged) {
+                portENTER_CRITICAL(&s_lock);
+                s_backlog_seq = record->seq;
+                portEXIT_CRITICAL(&s_lock);
+                ESP_LOGW(TAG, "RAM buffer full, spilling to the scan log");
+            } else {
+                s_dropped++;
+                ESP_LOGW(TAG, "RAM buffer full (%" PRIu32 " dropped)", s_dropped);
+            }
+        }
+    }
+}
+
+#endif
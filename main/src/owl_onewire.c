@@ -1,52 +1,555 @@
+#include "owl_onewire.h"
+#include "owl_mem.h"
+#include "owl_metrics.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
 #include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "nvs.h"
 
 #include "onewire_bus.h"
-#include "onewire_device.h"
+#include "onewire_crc.h"
 #include "onewire_types.h"
 
 #define TAG "owl_onewire"
 
-onewire_bus_handle_t s_bus;
+#define ONEWIRE_CMD_READ_ROM 0x33
+#define ONEWIRE_CMD_SEARCH_ROM 0xF0
+
+#define NVS_NAMESPACE "owl_onewire"
+
+#define CALIBRATION_ROUNDS CONFIG_OWL_ONEWIRE_CALIBRATION_ROUNDS
+#define CALIBRATION_MAX_DEVICES 16
+
+#define FULL_SEARCH_INTERVAL CONFIG_OWL_ONEWIRE_FULL_SEARCH_INTERVAL
+
+typedef struct {
+    onewire_bus_handle_t handle;
+    owl_onewire_timing_t timing;
+#ifdef CONFIG_OWL_ONEWIRE_INCREMENTAL_SEARCH
+    // ROM of the only device found by the last full walk, 0 if the population
+    // was empty, larger than one device or not fully walked
+    onewire_device_address_t cached_rom;
+    uint32_t scans_since_full_walk;
+#endif
+} owl_onewire_bus_t;
+
+// Calibration persisted per bus. Retries are not part of it and always come
+// from Kconfig; blobs written by older firmware still carry them at the end.
+typedef struct {
+    uint16_t reset_recovery_us;
+    uint16_t slot_recovery_us;
+} stored_timing_t;
+
+// Search state (Maxim AN187)
+typedef struct {
+    uint64_t rom;
+    int last_discrepancy;
+    bool last_device;
+} search_state_t;
+
+// Time budget and cancellation of a search, checked once per byte
+typedef struct {
+    int64_t deadline_us; // 0 for no deadline
+    const owl_onewire_cancel_t *cancel;
+} search_limit_t;
+
+OWL_METRIC_COUNTER_DEFINE(scans_metric,
+                          "owl_onewire_scans_total",
+                          "Bus searches run");
+OWL_METRIC_COUNTER_DEFINE(roms_metric,
+                          "owl_onewire_roms_found_total",
+                          "ROMs found by searches");
+OWL_METRIC_COUNTER_DEFINE(crc_errors_metric,
+                          "owl_onewire_crc_errors_total",
+                          "ROMs read with an invalid CRC, retries included");
+// Owned by the task running searches (owl_task)
+OWL_METRIC_HISTOGRAM_DEFINE(search_us_metric,
+                            "owl_onewire_search_duration_us",
+                            "Duration of bus searches in microseconds",
+                            1000,
+                            2000,
+                            5000,
+                            10000,
+                            20000,
+                            50000,
+                            100000,
+                            200000);
+
+static owl_onewire_bus_t s_buses[OWL_ONEWIRE_MAX_BUSES];
+static size_t s_bus_count = 0;
+static size_t s_bus_index = 0;
+
+static const owl_onewire_timing_t default_timing = {
+    .reset_recovery_us = 0,
+    .slot_recovery_us = 0,
+    .retries = CONFIG_OWL_ONEWIRE_SEARCH_RETRIES,
+};
+
+// Calibration candidates, most conservative first
+static const uint16_t reset_recovery_candidates[] = { 500, 200, 50, 0 };
+static const uint16_t slot_recovery_candidates[] = { 60, 20, 5, 0 };
+
+static void timing_load(size_t index, owl_onewire_timing_t *timing)
+{
+    char key[8];
+    nvs_handle_t nvs;
+    uint8_t blob[sizeof(owl_onewire_timing_t)];
+    size_t len = sizeof(blob);
+
+    *timing = default_timing;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+
+    snprintf(key, sizeof(key), "bus%zu", index);
+    if (nvs_get_blob(nvs, key, blob, &len) == ESP_OK
+        && len >= sizeof(stored_timing_t)) {
+        stored_timing_t stored;
+        memcpy(&stored, blob, sizeof(stored));
+        timing->reset_recovery_us = stored.reset_recovery_us;
+        timing->slot_recovery_us = stored.slot_recovery_us;
+    }
+    nvs_close(nvs);
+}
+
+static esp_err_t timing_store(size_t index, const owl_onewire_timing_t *timing)
+{
+    char key[8];
+    nvs_handle_t nvs;
+    stored_timing_t stored = {
+        .reset_recovery_us = timing->reset_recovery_us,
+        .slot_recovery_us = timing->slot_recovery_us,
+    };
+
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    snprintf(key, sizeof(key), "bus%zu", index);
+    ret = nvs_set_blob(nvs, key, &stored, sizeof(stored));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
 
 onewire_bus_handle_t owl_onewire_init(int bus_gpio_num)
 {
+    if (s_bus_count >= OWL_ONEWIRE_MAX_BUSES) {
+        ESP_LOGE(TAG, "Too many 1-Wire buses (GPIO%d ignored)", bus_gpio_num);
+        return NULL;
+    }
+
+    owl_metrics_register(&scans_metric);
+    owl_metrics_register(&roms_metric);
+    owl_metrics_register(&crc_errors_metric);
+    owl_metrics_register(&search_us_metric);
+
+    owl_onewire_bus_t *bus = &s_buses[s_bus_count];
     onewire_bus_config_t bus_config = {
         .bus_gpio_num = bus_gpio_num,
     };
     onewire_bus_rmt_config_t rmt_config = {
-        // 1byte ROM command + 8byte ROM number + 1byte device command
-        .max_rx_bytes = 10,
+        // Largest block read in one go by the memory readers
+        .max_rx_bytes = CONFIG_OWL_ONEWIRE_MAX_RX_BYTES,
     };
-    ESP_ERROR_CHECK(onewire_new_bus_rmt(&bus_config, &rmt_config, &s_bus));
-    ESP_LOGI(TAG, "1-Wire bus configured on GPIO%d", bus_gpio_num);
-    return s_bus;
+    size_t mem = owl_mem_track_begin();
+    ESP_ERROR_CHECK(
+        onewire_new_bus_rmt(&bus_config, &rmt_config, &bus->handle));
+    owl_mem_track_end(OWL_MEM_ONEWIRE, mem);
+
+    timing_load(s_bus_count, &bus->timing);
+    ESP_LOGI(TAG,
+             "1-Wire bus #%zu configured on GPIO%d (recovery: reset %u us, "
+             "slot %u us)",
+             s_bus_count,
+             bus_gpio_num,
+             bus->timing.reset_recovery_us,
+             bus->timing.slot_recovery_us);
+
+    s_bus_count++;
+    return bus->handle;
 }
 
-size_t owl_onewire_search(onewire_device_address_t buff[], size_t max_devices)
+esp_err_t owl_onewire_select_bus(size_t index)
 {
-    onewire_device_iter_handle_t iter = NULL;
-    onewire_device_t next_onewire_device;
-    esp_err_t search_result = ESP_OK;
-    size_t device_count = 0;
-    onewire_device_address_t *buff_ptr = buff;
+    if (index >= s_bus_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    ESP_ERROR_CHECK(onewire_new_device_iter(s_bus, &iter));
-    while (1) {
-        search_result
-            = onewire_device_iter_get_next(iter, &next_onewire_device);
-        if (search_result != ESP_OK) {
-            break;
+    s_bus_index = index;
+    ESP_LOGI(TAG, "Selected 1-Wire bus #%zu", index);
+    return ESP_OK;
+}
+
+onewire_bus_handle_t owl_onewire_bus(void)
+{
+    return s_buses[s_bus_index].handle;
+}
+
+void owl_onewire_get_timing(owl_onewire_timing_t *timing)
+{
+    *timing = s_buses[s_bus_index].timing;
+}
+
+static inline void slot_recovery(const owl_onewire_timing_t *timing)
+{
+    if (timing->slot_recovery_us) {
+        esp_rom_delay_us(timing->slot_recovery_us);
+    }
+}
+
+static esp_err_t search_limit_check(const search_limit_t *limit)
+{
+    if (limit->cancel && owl_onewire_cancelled(limit->cancel)) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+    if (limit->deadline_us && esp_timer_get_time() >= limit->deadline_us) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+// Walks a single branch of the ROM search tree
+static esp_err_t search_branch(onewire_bus_handle_t bus,
+                               const owl_onewire_timing_t *timing,
+                               const search_limit_t *limit,
+                               search_state_t *state)
+{
+    esp_err_t ret = onewire_bus_reset(bus);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (timing->reset_recovery_us) {
+        esp_rom_delay_us(timing->reset_recovery_us);
+    }
+
+    uint8_t cmd = ONEWIRE_CMD_SEARCH_ROM;
+    ret = onewire_bus_write_bytes(bus, &cmd, 1);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    uint64_t rom = 0;
+    int last_zero = 0;
+    for (int bit = 0; bit < 64; bit++) {
+        uint8_t id_bit, cmp_bit, dir;
+
+        // Once per byte keeps the overhead well below a slot
+        if (bit % 8 == 0) {
+            ret = search_limit_check(limit);
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        }
+
+        ret = onewire_bus_read_bit(bus, &id_bit);
+        slot_recovery(timing);
+        if (ret == ESP_OK) {
+            ret = onewire_bus_read_bit(bus, &cmp_bit);
+            slot_recovery(timing);
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        if (id_bit && cmp_bit) {
+            // Nobody answered - device dropped off mid-search or a glitch
+            return ESP_ERR_INVALID_RESPONSE;
+        } else if (id_bit != cmp_bit) {
+            dir = id_bit;
+        } else if (bit + 1 < state->last_discrepancy) {
+            dir = (state->rom >> bit) & 1;
+        } else {
+            dir = bit + 1 == state->last_discrepancy;
+        }
+
+        if (id_bit == cmp_bit && dir == 0) {
+            last_zero = bit + 1;
+        }
+        rom |= (uint64_t) dir << bit;
+
+        ret = onewire_bus_write_bit(bus, dir);
+        slot_recovery(timing);
+        if (ret != ESP_OK) {
+            return ret;
         }
+    }
 
-        if (device_count >= max_devices) {
-            ESP_LOGW(TAG, "Reached max device count: aborting");
+    // A shorted line reads as all zeros, which has a valid CRC
+    uint8_t *rom_bytes = (uint8_t *) &rom;
+    if (rom == 0 || onewire_crc8(0, rom_bytes, 8) != 0) {
+        owl_metric_inc(&crc_errors_metric);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    state->rom = rom;
+    state->last_discrepancy = last_zero;
+    state->last_device = last_zero == 0;
+    return ESP_OK;
+}
+
+// Full walk of the ROM search tree. `complete` (may be NULL) tells whether
+// every device on the bus was found.
+static esp_err_t search_bus(const owl_onewire_bus_t *bus,
+                            const owl_onewire_timing_t *timing,
+                            const search_limit_t *limit,
+                            onewire_device_address_t buff[],
+                            size_t max_devices,
+                            size_t *count,
+                            bool *complete)
+{
+    search_state_t state = { 0 };
+    esp_err_t ret = ESP_OK;
+
+    *count = 0;
+    while (!state.last_device && *count < max_devices) {
+        // Only a successful branch updates the state, so a retry walks the
+        // same branch again
+        for (int attempt = 0; attempt <= timing->retries; attempt++) {
+            ret = search_branch(bus->handle, timing, limit, &state);
+            if (ret == ESP_OK || ret == ESP_ERR_NOT_FOUND
+                || ret == ESP_ERR_TIMEOUT || ret == ESP_ERR_NOT_FINISHED) {
+                break;
+            }
+        }
+
+        if (ret == ESP_ERR_NOT_FOUND && *count == 0) {
+            state.last_device = true; // no presence pulse: empty bus
+            ret = ESP_OK;
+            break;
+        }
+        if (ret != ESP_OK) {
             break;
         }
+        buff[(*count)++] = state.rom;
+    }
+
+    if (ret == ESP_OK && !state.last_device) {
+        ESP_LOGW(TAG, "Reached max device count: aborting");
+    }
+    if (complete) {
+        *complete = ret == ESP_OK && state.last_device;
+    }
+    return ret;
+}
 
-        *buff_ptr++ = next_onewire_device.address;
-        device_count++;
+#ifdef CONFIG_OWL_ONEWIRE_INCREMENTAL_SEARCH
+// Reads the ROM of a lone device (Read ROM): 64 read slots instead of the 192
+// slots of a search branch. Several devices answer at once and read as the
+// AND of their ROMs, which almost always fails CRC.
+static esp_err_t read_rom(onewire_bus_handle_t bus,
+                          const owl_onewire_timing_t *timing,
+                          uint64_t *rom)
+{
+    esp_err_t ret = onewire_bus_reset(bus);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (timing->reset_recovery_us) {
+        esp_rom_delay_us(timing->reset_recovery_us);
+    }
+
+    uint8_t cmd = ONEWIRE_CMD_READ_ROM;
+    ret = onewire_bus_write_bytes(bus, &cmd, 1);
+    if (ret == ESP_OK) {
+        ret = onewire_bus_read_bytes(bus, (uint8_t *) rom, sizeof(*rom));
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (*rom == 0 || onewire_crc8(0, (uint8_t *) rom, 8) != 0) {
+        owl_metric_inc(&crc_errors_metric);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+// Incremental rescan: while the last full walk found a single device, checks
+// that it is still the one answering with a Read ROM rather than walking the
+// tree again. Returns ESP_ERR_INVALID_STATE when the population may have
+// changed and a full walk is needed.
+static esp_err_t search_cached(owl_onewire_bus_t *bus,
+                               const search_limit_t *limit,
+                               onewire_device_address_t buff[],
+                               size_t *count)
+{
+    *count = 0;
+    if (bus->cached_rom == 0
+        || bus->scans_since_full_walk >= FULL_SEARCH_INTERVAL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = search_limit_check(limit);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    uint64_t rom;
+    ret = read_rom(bus->handle, &bus->timing, &rom);
+    if (ret == ESP_OK && rom == bus->cached_rom) {
+        bus->scans_since_full_walk++;
+        buff[(*count)++] = rom;
+        return ESP_OK;
+    }
+    if (ret == ESP_ERR_NOT_FOUND) {
+        // Device removed: the next scan walks the (cheap) empty tree
+        bus->cached_rom = 0;
+        return ESP_OK;
+    }
+
+    // Another device, several of them or a glitch
+    ESP_LOGD(TAG, "Cached population diverged (%s)", esp_err_to_name(ret));
+    return ESP_ERR_INVALID_STATE;
+}
+#endif
+
+static esp_err_t search_selected_bus(onewire_device_address_t buff[],
+                                     size_t max_devices,
+                                     const search_limit_t *limit,
+                                     size_t *count)
+{
+    owl_onewire_bus_t *bus = &s_buses[s_bus_index];
+    esp_err_t ret;
+
+#ifdef CONFIG_OWL_ONEWIRE_INCREMENTAL_SEARCH
+    if (max_devices > 0) {
+        ret = search_cached(bus, limit, buff, count);
+        if (ret != ESP_ERR_INVALID_STATE) {
+            return ret;
+        }
+    }
+#endif
+
+    bool complete;
+    ret = search_bus(
+        bus, &bus->timing, limit, buff, max_devices, count, &complete);
+
+#ifdef CONFIG_OWL_ONEWIRE_INCREMENTAL_SEARCH
+    bus->cached_rom = complete && *count == 1 ? buff[0] : 0;
+    bus->scans_since_full_walk = 0;
+#endif
+
+    return ret;
+}
+
+esp_err_t owl_onewire_search(onewire_device_address_t buff[],
+                             size_t max_devices,
+                             int64_t budget_us,
+                             const owl_onewire_cancel_t *cancel,
+                             size_t *count)
+{
+    int64_t start_us = esp_timer_get_time();
+    const search_limit_t limit = {
+        .deadline_us = budget_us > 0 ? start_us + budget_us : 0,
+        .cancel = cancel,
+    };
+
+    esp_err_t ret = search_selected_bus(buff, max_devices, &limit, count);
+
+    owl_metric_inc(&scans_metric);
+    owl_metric_add(&roms_metric, *count);
+    owl_metric_observe(&search_us_metric, esp_timer_get_time() - start_us);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG,
+                 "Search stopped after %zu devices: %s",
+                 *count,
+                 esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+// Calibration measures timings, it is not bounded
+static const search_limit_t no_limit = { 0 };
+
+static bool calibration_round_ok(const owl_onewire_bus_t *bus,
+                                 const owl_onewire_timing_t *timing,
+                                 const onewire_device_address_t reference[],
+                                 size_t reference_count)
+{
+    onewire_device_address_t found[CALIBRATION_MAX_DEVICES];
+    size_t count;
+
+    esp_err_t ret = search_bus(
+        bus, timing, &no_limit, found, CALIBRATION_MAX_DEVICES, &count, NULL);
+    return ret == ESP_OK && count == reference_count
+        && memcmp(found, reference, count * sizeof(found[0])) == 0;
+}
+
+esp_err_t owl_onewire_calibrate(void)
+{
+    owl_onewire_bus_t *bus = &s_buses[s_bus_index];
+    onewire_device_address_t reference[CALIBRATION_MAX_DEVICES];
+    size_t reference_count;
+
+    // Establish the population with the most conservative timing
+    owl_onewire_timing_t timing = {
+        .reset_recovery_us = reset_recovery_candidates[0],
+        .slot_recovery_us = slot_recovery_candidates[0],
+        .retries = default_timing.retries,
+    };
+    esp_err_t ret = search_bus(bus,
+                               &timing,
+                               &no_limit,
+                               reference,
+                               CALIBRATION_MAX_DEVICES,
+                               &reference_count,
+                               NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Calibration reference search failed");
+        return ret;
+    }
+    if (reference_count == 0) {
+        ESP_LOGE(TAG, "Calibration needs at least one device on the bus");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Rounds run without retries, so that marginal timings show up
+    owl_onewire_timing_t best = timing;
+    timing.retries = 0;
+    for (size_t s = 0; s < sizeof(slot_recovery_candidates)
+                               / sizeof(slot_recovery_candidates[0]);
+         s++) {
+        for (size_t r = 0; r < sizeof(reset_recovery_candidates)
+                                   / sizeof(reset_recovery_candidates[0]);
+             r++) {
+            timing.slot_recovery_us = slot_recovery_candidates[s];
+            timing.reset_recovery_us = reset_recovery_candidates[r];
+
+            size_t round = 0;
+            while (round < CALIBRATION_ROUNDS
+                   && calibration_round_ok(
+                       bus, &timing, reference, reference_count)) {
+                round++;
+            }
+
+            ESP_LOGI(TAG,
+                     "Calibration: reset %u us, slot %u us: %zu/%d",
+                     timing.reset_recovery_us,
+                     timing.slot_recovery_us,
+                     round,
+                     CALIBRATION_ROUNDS);
+            if (round == CALIBRATION_ROUNDS) {
+                best.slot_recovery_us = timing.slot_recovery_us;
+                best.reset_recovery_us = timing.reset_recovery_us;
+            }
+        }
     }
 
-    ESP_ERROR_CHECK(onewire_del_device_iter(iter));
-    return device_count;
+    bus->timing = best;
+    ESP_LOGI(TAG,
+             "Calibrated bus #%zu (%zu devices): reset %u us, slot %u us",
+             s_bus_index,
+             reference_count,
+             best.reset_recovery_us,
+             best.slot_recovery_us);
+    return timing_store(s_bus_index, &best);
 }
@@ -0,0 +1,259 @@
+#include "owl_onewire.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "onewire_bus.h"
+
+#define TAG "owl_onewire_mem"
+
+#define ONEWIRE_CMD_MATCH_ROM 0x55
+#define CMD_READ_MEMORY 0xF0
+#define CMD_READ_AUTH_PAGE 0xA5
+#define CMD_EXTENDED_READ_MEMORY 0xA5
+
+#define MAX_RX_BYTES CONFIG_OWL_ONEWIRE_MAX_RX_BYTES
+#define MAX_PAGE_SIZE 32
+
+typedef struct owl_onewire_family owl_onewire_family_t;
+
+typedef esp_err_t (*read_fn_t)(onewire_bus_handle_t bus,
+                               onewire_device_address_t rom,
+                               const owl_onewire_family_t *family,
+                               uint8_t *buff,
+                               size_t len);
+
+struct owl_onewire_family {
+    uint8_t code;
+    const char *name;
+    uint16_t memory_size;
+    uint8_t page_size;
+    read_fn_t read;
+};
+
+// CRC16 as used by 1-Wire devices (x^16 + x^15 + x^2 + 1, LSB first)
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+// Devices send the inverted CRC16, LSB first
+static inline bool crc16_check(uint16_t crc, const uint8_t rx[2])
+{
+    return (uint16_t) ~crc == (rx[0] | rx[1] << 8);
+}
+
+static esp_err_t select_device(onewire_bus_handle_t bus,
+                               onewire_device_address_t rom)
+{
+    uint8_t tx[9] = { ONEWIRE_CMD_MATCH_ROM };
+    memcpy(&tx[1], &rom, sizeof(rom));
+
+    esp_err_t ret = onewire_bus_reset(bus);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return onewire_bus_write_bytes(bus, tx, sizeof(tx));
+}
+
+static esp_err_t send_command(onewire_bus_handle_t bus,
+                              onewire_device_address_t rom,
+                              uint8_t cmd,
+                              uint16_t address,
+                              uint16_t *crc)
+{
+    uint8_t tx[3] = { cmd, address & 0xFF, address >> 8 };
+
+    esp_err_t ret = select_device(bus, rom);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    *crc = crc16(0, tx, sizeof(tx));
+    return onewire_bus_write_bytes(bus, tx, sizeof(tx));
+}
+
+// Streams `len` bytes off the bus in the largest blocks the RMT receiver
+// allows, folding them into `crc` as they arrive. With `buff` NULL the data is
+// only checksummed.
+static esp_err_t read_stream(onewire_bus_handle_t bus,
+                             uint8_t *buff,
+                             size_t len,
+                             uint16_t *crc)
+{
+    uint8_t scratch[MAX_RX_BYTES];
+
+    while (len > 0) {
+        size_t block = len < MAX_RX_BYTES ? len : MAX_RX_BYTES;
+        uint8_t *rx = buff ? buff : scratch;
+
+        esp_err_t ret = onewire_bus_read_bytes(bus, rx, block);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        *crc = crc16(*crc, rx, block);
+
+        if (buff) {
+            buff += block;
+        }
+        len -= block;
+    }
+    return ESP_OK;
+}
+
+// Read Memory (F0h) carries no CRC, so memory is streamed twice and the
+// CRC16 of both passes compared
+static esp_err_t read_memory_verified(onewire_bus_handle_t bus,
+                                      onewire_device_address_t rom,
+                                      const owl_onewire_family_t *family,
+                                      uint8_t *buff,
+                                      size_t len)
+{
+    uint16_t crc[2];
+
+    for (int pass = 0; pass < 2; pass++) {
+        esp_err_t ret = send_command(bus, rom, CMD_READ_MEMORY, 0, &crc[pass]);
+        if (ret == ESP_OK) {
+            ret = read_stream(bus, pass == 0 ? buff : NULL, len, &crc[pass]);
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    return crc[0] == crc[1] ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+// Read Authenticated Page (A5h): page data, FFh and CRC16 of all of it. The
+// MAC that follows needs the device secret and is skipped by resetting.
+static esp_err_t read_authenticated_pages(onewire_bus_handle_t bus,
+                                          onewire_device_address_t rom,
+                                          const owl_onewire_family_t *family,
+                                          uint8_t *buff,
+                                          size_t len)
+{
+    uint8_t page[MAX_PAGE_SIZE + 3];
+
+    for (size_t address = 0; address < len; address += family->page_size) {
+        uint16_t crc;
+        size_t chunk = len - address < family->page_size ? len - address
+                                                         : family->page_size;
+
+        esp_err_t ret
+            = send_command(bus, rom, CMD_READ_AUTH_PAGE, address, &crc);
+        if (ret == ESP_OK) {
+            ret = read_stream(bus, page, family->page_size + 1, &crc);
+        }
+        if (ret == ESP_OK) {
+            ret = onewire_bus_read_bytes(
+                bus, &page[family->page_size + 1], 2);
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        if (!crc16_check(crc, &page[family->page_size + 1])) {
+            ESP_LOGW(TAG, "CRC16 mismatch on page @%zu", address);
+            return ESP_ERR_INVALID_CRC;
+        }
+        memcpy(buff + address, page, chunk);
+    }
+
+    onewire_bus_reset(bus);
+    return ESP_OK;
+}
+
+// Extended Read Memory (A5h): streams page after page, each followed by its
+// CRC16 (the first one also covering command and address)
+static esp_err_t read_extended_memory(onewire_bus_handle_t bus,
+                                      onewire_device_address_t rom,
+                                      const owl_onewire_family_t *family,
+                                      uint8_t *buff,
+                                      size_t len)
+{
+    uint8_t page[MAX_PAGE_SIZE];
+    uint8_t rx_crc[2];
+    uint16_t crc;
+
+    esp_err_t ret = send_command(bus, rom, CMD_EXTENDED_READ_MEMORY, 0, &crc);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    for (size_t address = 0; address < len; address += family->page_size) {
+        size_t chunk = len - address < family->page_size ? len - address
+                                                         : family->page_size;
+
+        // Full pages land directly in the caller's buffer
+        uint8_t *rx = chunk == family->page_size ? buff + address : page;
+        ret = read_stream(bus, rx, family->page_size, &crc);
+        if (ret == ESP_OK) {
+            ret = onewire_bus_read_bytes(bus, rx_crc, sizeof(rx_crc));
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        if (!crc16_check(crc, rx_crc)) {
+            ESP_LOGW(TAG, "CRC16 mismatch on page @%zu", address);
+            return ESP_ERR_INVALID_CRC;
+        }
+        if (rx == page) {
+            memcpy(buff + address, page, chunk);
+        }
+        crc = 0;
+    }
+
+    onewire_bus_reset(bus);
+    return ESP_OK;
+}
+
+static const owl_onewire_family_t families[] = {
+    { 0x2D, "DS2431", 128, 32, read_memory_verified },
+    { 0x23, "DS2433", 512, 32, read_memory_verified },
+    { 0x33, "DS2432", 128, 32, read_authenticated_pages },
+    { 0x2F, "DS28E01", 128, 32, read_authenticated_pages },
+    { 0x43, "DS28EC20", 2560, 32, read_extended_memory },
+};
+
+static const owl_onewire_family_t *family_of(onewire_device_address_t rom)
+{
+    for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+        if (families[i].code == (rom & 0xFF)) {
+            return &families[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t owl_onewire_read_memory(onewire_device_address_t rom,
+                                  uint8_t *buff,
+                                  size_t max_len,
+                                  size_t *len)
+{
+    const owl_onewire_family_t *family = family_of(rom);
+    *len = 0;
+    if (!family) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    size_t read_len
+        = max_len < family->memory_size ? max_len : family->memory_size;
+    esp_err_t ret = family->read(owl_onewire_bus(), rom, family, buff, read_len);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG,
+                 "Failed to read %s memory: %s",
+                 family->name,
+                 esp_err_to_name(ret));
+        return ret;
+    }
+
+    *len = read_len;
+    return ESP_OK;
+}
@@ -0,0 +1,315 @@
+#include "owl_pipeline.h"
+#include "owl_display.h"
+#include "owl_http_server.h"
+#include "owl_log.h"
+#include "owl_mqtt.h"
+#include "owl_scanlog.h"
+#include "owl_static.h"
+#include "owl_trace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "owl_pipeline";
+
+#define FORMAT_QUEUE_LEN CONFIG_OWL_PIPELINE_FORMAT_QUEUE_LEN
+#define WS_QUEUE_LEN CONFIG_OWL_PIPELINE_WS_QUEUE_LEN
+
+#if defined(CONFIG_OWL_PIPELINE_FORMAT_DROP_OLDEST)
+#define FORMAT_OVERFLOW OWL_OVERFLOW_DROP_OLDEST
+#elif defined(CONFIG_OWL_PIPELINE_FORMAT_BLOCK)
+#define FORMAT_OVERFLOW OWL_OVERFLOW_BLOCK
+#else
+#define FORMAT_OVERFLOW OWL_OVERFLOW_DROP_NEWEST
+#endif
+
+#if defined(CONFIG_OWL_PIPELINE_WS_DROP_NEWEST)
+#define WS_OVERFLOW OWL_OVERFLOW_DROP_NEWEST
+#elif defined(CONFIG_OWL_PIPELINE_WS_BLOCK)
+#define WS_OVERFLOW OWL_OVERFLOW_BLOCK
+#else
+#define WS_OVERFLOW OWL_OVERFLOW_DROP_OLDEST
+#endif
+
+// Status replies are never dropped, and one is pushed per command
+#define REPLY_QUEUE_LEN CONFIG_OWL_COMMAND_QUEUE_LEN
+
+#define STAGE_STACK_SIZE 3072
+#define FORMAT_PRIORITY 4
+#define WS_PRIORITY 3
+
+// Every queued record, plus one being processed (or held) by each stage, must
+// fit in the record pool for acquisition to never run out of records
+_Static_assert(CONFIG_OWL_POOL_RECORD_COUNT >= FORMAT_QUEUE_LEN + WS_QUEUE_LEN
+                                                  + 3,
+               "Record pool too small for the pipeline queues");
+
+typedef struct {
+    owl_scan_record_t *record; // NULL for status replies
+    uint32_t id;
+    int fd;
+    const char *status;
+    // Records: position among the records pushed to the stage. Replies: number
+    // of records pushed before them, which must be delivered first.
+    uint32_t seq;
+} pipeline_item_t;
+
+// Records and status replies travel in separate queues, so that the overflow
+// policy of the records can never touch a reply: a reply waits for room
+// instead. The consumer merges both back in push order using `seq`.
+typedef struct {
+    const char *name;
+    owl_overflow_t policy;
+    QueueHandle_t queue;   // records
+    QueueHandle_t replies; // status replies
+    TaskHandle_t consumer; // notified on every push
+    uint32_t next_seq;     // producer only
+    uint32_t pushed;
+    uint32_t dropped;
+    // Consumer only: oldest record not delivered yet, taken out of the queue
+    pipeline_item_t held;
+    bool holding;
+} stage_queue_t;
+
+OWL_QUEUE_DEFINE(format_queue, FORMAT_QUEUE_LEN, sizeof(pipeline_item_t));
+OWL_QUEUE_DEFINE(format_replies, REPLY_QUEUE_LEN, sizeof(pipeline_item_t));
+OWL_QUEUE_DEFINE(ws_queue, WS_QUEUE_LEN, sizeof(pipeline_item_t));
+OWL_QUEUE_DEFINE(ws_replies, REPLY_QUEUE_LEN, sizeof(pipeline_item_t));
+OWL_TASK_DEFINE(format_task, STAGE_STACK_SIZE, 1);
+OWL_TASK_DEFINE(ws_task, STAGE_STACK_SIZE, 1);
+
+static stage_queue_t s_format_queue = {
+    .name = "format",
+    .policy = FORMAT_OVERFLOW,
+};
+
+static stage_queue_t s_ws_queue = {
+    .name = "ws",
+    .policy = WS_OVERFLOW,
+};
+
+static stage_queue_t *const s_queues[] = {
+    &s_format_queue,
+    &s_ws_queue,
+};
+
+static void item_release(pipeline_item_t *item)
+{
+    if (item->record) {
+        owl_scan_record_free(item->record);
+    }
+}
+
+// Only ever called by the single producer of `q`. The overflow policy only
+// applies to records: a status reply completes a command a client waits for,
+// so it is never dropped and waits for room instead.
+static void stage_push(stage_queue_t *q, pipeline_item_t *item)
+{
+    q->pushed++;
+
+    if (!item->record) {
+        item->seq = q->next_seq;
+        xQueueSend(q->replies, item, portMAX_DELAY);
+        xTaskNotifyGive(q->consumer);
+        return;
+    }
+
+    item->seq = q->next_seq++;
+    switch (q->policy) {
+    case OWL_OVERFLOW_BLOCK:
+        xQueueSend(q->queue, item, portMAX_DELAY);
+        break;
+    case OWL_OVERFLOW_DROP_OLDEST:
+        while (xQueueSend(q->queue, item, 0) != pdTRUE) {
+            pipeline_item_t oldest;
+            if (xQueueReceive(q->queue, &oldest, 0) == pdTRUE) {
+                item_release(&oldest);
+                q->dropped++;
+            }
+        }
+        break;
+    case OWL_OVERFLOW_DROP_NEWEST:
+    default:
+        if (xQueueSend(q->queue, item, 0) != pdTRUE) {
+            item_release(item);
+            q->dropped++;
+            return;
+        }
+        break;
+    }
+    xTaskNotifyGive(q->consumer);
+}
+
+// Only ever called by the consumer of `q`: takes the next item in push order,
+// waiting for one. A reply is due once no record pushed before it is left.
+// The reply is looked at before the records, so that every record it waits
+// for is already queued (or dropped) by then.
+static void stage_pop(stage_queue_t *q, pipeline_item_t *item)
+{
+    while (1) {
+        pipeline_item_t reply;
+        bool has_reply = xQueuePeek(q->replies, &reply, 0) == pdTRUE;
+        if (!q->holding) {
+            q->holding = xQueueReceive(q->queue, &q->held, 0) == pdTRUE;
+        }
+
+        if (has_reply
+            && (!q->holding || (int32_t) (q->held.seq - reply.seq) >= 0)) {
+            xQueueReceive(q->replies, item, 0);
+            return;
+        }
+        if (q->holding) {
+            *item = q->held;
+            q->holding = false;
+            return;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// Formats the WebSocket message into `record->text` and shows the devices on
+// the display
+static void format_record(owl_scan_record_t *record)
+{
+    char *text_ptr = record->text;
+
+    for (size_t i = 0; i < record->count; i++) {
+        OWL_TRACE_TIMESTAMP(format_start);
+        OWL_LOGI(TAG, "Found device #%zu: %" PRIX64, i, record->addresses[i]);
+        if (record->id != 0) {
+            text_ptr += sprintf(text_ptr, "%" PRIu32 " ", record->id);
+        }
+        text_ptr += sprintf(text_ptr, "%" PRIX64, record->addresses[i]);
+#ifdef CONFIG_OWL_ONEWIRE_READ_MEMORY
+        if (record->memory_len[i] > 0) {
+            *text_ptr++ = ' ';
+        }
+        for (size_t j = 0; j < record->memory_len[i]; j++) {
+            text_ptr += sprintf(text_ptr, "%02X", record->memory[i][j]);
+        }
+#endif
+        *text_ptr++ = '\n';
+
+        char disp_buff[17];
+        snprintf(disp_buff, 17, "%" PRIX64, record->addresses[i]);
+        OWL_TRACE_SPAN(OWL_TRACE_FORMAT, format_start);
+
+        OWL_TRACE_TIMESTAMP(display_start);
+        owl_display("OneWire:", disp_buff, owl_rgb(OWL_COLOR_WHITE), 5000);
+        OWL_TRACE_SPAN(OWL_TRACE_DISPLAY, display_start);
+    }
+    *text_ptr = '\0';
+}
+
+static void owl_format_task(void *arg)
+{
+    pipeline_item_t item;
+
+    while (1) {
+        stage_pop(&s_format_queue, &item);
+        if (item.record) {
+            format_record(item.record);
+            // Remote scans that found nothing have nothing to report
+            if (item.record->count == 0 && item.record->id != 0) {
+                item_release(&item);
+                continue;
+            }
+        }
+        stage_push(&s_ws_queue, &item);
+    }
+}
+
+static void owl_ws_task(void *arg)
+{
+    pipeline_item_t item;
+
+    while (1) {
+        stage_pop(&s_ws_queue, &item);
+        if (item.record) {
+            OWL_TRACE_TIMESTAMP(ws_send_start);
+            owl_ws_send(item.fd, item.record->text);
+            OWL_TRACE_SPAN(OWL_TRACE_WS_SEND, ws_send_start);
+            OWL_TRACE_SPAN(OWL_TRACE_TOTAL, item.record->origin_us);
+        } else {
+            char buff[32];
+            snprintf(buff, sizeof(buff), "%" PRIu32 " %s", item.id, item.status);
+            owl_ws_send(item.fd, buff);
+        }
+        item_release(&item);
+    }
+}
+
+void owl_pipeline_init(void)
+{
+    s_format_queue.queue = OWL_QUEUE_CREATE(format_queue);
+    s_format_queue.replies = OWL_QUEUE_CREATE(format_replies);
+    s_ws_queue.queue = OWL_QUEUE_CREATE(ws_queue);
+    s_ws_queue.replies = OWL_QUEUE_CREATE(ws_replies);
+
+    // Consumers first, each stage notifies the next one
+    s_ws_queue.consumer = OWL_TASK_CREATE(ws_task,
+                                          0,
+                                          owl_ws_task,
+                                          "owl_ws_task",
+                                          NULL,
+                                          WS_PRIORITY,
+                                          tskNO_AFFINITY);
+    s_format_queue.consumer = OWL_TASK_CREATE(format_task,
+                                              0,
+                                              owl_format_task,
+                                              "owl_format_task",
+                                              NULL,
+                                              FORMAT_PRIORITY,
+                                              tskNO_AFFINITY);
+
+    ESP_LOGI(TAG,
+             "Initialized pipeline (format queue %d, ws queue %d)",
+             FORMAT_QUEUE_LEN,
+             WS_QUEUE_LEN);
+}
+
+void owl_pipeline_submit(owl_scan_record_t *record)
+{
+    // Storage comes before any stage that may drop the record. Both only copy
+    // it into their own queues, without blocking.
+    owl_scanlog_record_t logged[OWL_SCAN_MAX_DEVICES];
+    owl_scanlog_append(record, logged);
+    owl_mqtt_publish(logged, record->count);
+
+    pipeline_item_t item = {
+        .record = record,
+        .id = record->id,
+        .fd = record->fd,
+    };
+    stage_push(&s_format_queue, &item);
+}
+
+void owl_pipeline_reply(uint32_t id, int fd, const char *status)
+{
+    pipeline_item_t item = {
+        .id = id,
+        .fd = fd,
+        .status = status,
+    };
+    stage_push(&s_format_queue, &item);
+}
+
+bool owl_pipeline_queue_stats(size_t i, owl_pipeline_queue_stats_t *stats)
+{
+    if (i >= sizeof(s_queues) / sizeof(s_queues[0])) {
+        return false;
+    }
+
+    const stage_queue_t *q = s_queues[i];
+    stats->name = q->name;
+    stats->policy = q->policy;
+    stats->pushed = q->pushed;
+    stats->dropped = q->dropped;
+    stats->waiting = q->queue ? uxQueueMessagesWaiting(q->queue) : 0;
+    return true;
+}
@@ -0,0 +1,64 @@
+#include "owl_pool.h"
+
+#include "esp_log.h"
+
+static const char *TAG = "owl_pool";
+
+static owl_pool_t *s_pools = NULL;
+static portMUX_TYPE s_pools_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void owl_pool_init(owl_pool_t *pool)
+{
+    // Thread the free list through the blocks themselves
+    pool->free_list = NULL;
+    for (size_t i = pool->block_count; i > 0; i--) {
+        void **block = (void **) (pool->storage + (i - 1) * pool->block_size);
+        *block = pool->free_list;
+        pool->free_list = block;
+    }
+
+    portENTER_CRITICAL(&s_pools_lock);
+    pool->next = s_pools;
+    s_pools = pool;
+    portEXIT_CRITICAL(&s_pools_lock);
+
+    ESP_LOGI(TAG,
+             "Initialized pool %s (%zu x %zu B)",
+             pool->name,
+             pool->block_count,
+             pool->block_size);
+}
+
+void *owl_pool_alloc(owl_pool_t *pool)
+{
+    portENTER_CRITICAL(&pool->lock);
+    void **block = pool->free_list;
+    if (block) {
+        pool->free_list = *block;
+        if (++pool->used > pool->peak) {
+            pool->peak = pool->used;
+        }
+    } else {
+        pool->failures++;
+    }
+    portEXIT_CRITICAL(&pool->lock);
+    return block;
+}
+
+void owl_pool_free(owl_pool_t *pool, void *block)
+{
+    if (!block) {
+        return;
+    }
+
+    portENTER_CRITICAL(&pool->lock);
+    *(void **) block = pool->free_list;
+    pool->free_list = block;
+    pool->used--;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+const owl_pool_t *owl_pool_next(const owl_pool_t *pool)
+{
+    return pool ? pool->next : s_pools;
+}
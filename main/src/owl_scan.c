@@ -0,0 +1,22 @@
+#include "owl_scan.h"
+#include "owl_pool.h"
+
+OWL_POOL_DEFINE(record_pool,
+                "scan_record",
+                sizeof(owl_scan_record_t),
+                CONFIG_OWL_POOL_RECORD_COUNT);
+
+void owl_scan_init(void)
+{
+    owl_pool_init(&record_pool);
+}
+
+owl_scan_record_t *owl_scan_record_alloc(void)
+{
+    return owl_pool_alloc(&record_pool);
+}
+
+void owl_scan_record_free(owl_scan_record_t *record)
+{
+    owl_pool_free(&record_pool, record);
+}
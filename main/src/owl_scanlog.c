@@ -0,0 +1,386 @@
+#include "owl_scanlog.h"
+#include "owl_static.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char *TAG = "owl_scanlog";
+
+#define PARTITION_LABEL "scanlog"
+#define PARTITION_SUBTYPE 0x40
+
+#define SECTOR_SIZE 4096
+#define PAGE_SIZE 256
+#define RECORD_SIZE sizeof(owl_scanlog_record_t)
+#define RECORDS_PER_SECTOR (SECTOR_SIZE / RECORD_SIZE)
+#define RECORDS_PER_PAGE (PAGE_SIZE / RECORD_SIZE)
+#define MAX_SECTORS 256
+
+#define QUEUE_LEN CONFIG_OWL_SCANLOG_QUEUE_LEN
+#define FLUSH_INTERVAL_MS CONFIG_OWL_SCANLOG_FLUSH_MS
+#define RETENTION CONFIG_OWL_SCANLOG_RETENTION
+
+#define WRITER_STACK_SIZE 3072
+#define WRITER_PRIORITY 2
+
+_Static_assert(sizeof(owl_scanlog_record_t) == 32,
+               "Scan log records must evenly fill flash pages");
+
+static const esp_partition_t *s_partition = NULL;
+static size_t s_sector_count;
+static size_t s_retained_sectors;
+
+// Sequence index: first seq of every sector, OWL_SCANLOG_SEQ_NONE if erased.
+// Index and head position are only modified by the writer task, `s_lock`
+// keeps readers consistent.
+static uint32_t s_sector_seq[MAX_SECTORS];
+static size_t s_head_sector = 0;
+static size_t s_head_offset = 0;
+static uint32_t s_flushed_seq = 0; // seq following the last flushed record
+static SemaphoreHandle_t s_lock;
+
+// Assigned by owl_scanlog_append(), which only the pipeline calls
+static uint32_t s_next_seq = 0;
+
+static QueueHandle_t s_queue = NULL;
+OWL_QUEUE_DEFINE(writer_queue, QUEUE_LEN, sizeof(owl_scanlog_record_t));
+OWL_TASK_DEFINE(writer_task, WRITER_STACK_SIZE, 1);
+OWL_MUTEX_DEFINE(index_lock);
+static uint32_t s_dropped = 0;
+
+static uint32_t record_crc(const owl_scanlog_record_t *record)
+{
+    return esp_rom_crc32_le(
+        0, (const uint8_t *) record, offsetof(owl_scanlog_record_t, crc));
+}
+
+static bool record_valid(const owl_scanlog_record_t *record)
+{
+    return record->seq != OWL_SCANLOG_SEQ_NONE
+        && record->crc == record_crc(record);
+}
+
+static bool record_erased(const owl_scanlog_record_t *record)
+{
+    const uint8_t *bytes = (const uint8_t *) record;
+    for (size_t i = 0; i < RECORD_SIZE; i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static esp_err_t sector_erase(size_t sector)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_sector_seq[sector] = OWL_SCANLOG_SEQ_NONE;
+    xSemaphoreGive(s_lock);
+
+    return esp_partition_erase_range(
+        s_partition, sector * SECTOR_SIZE, SECTOR_SIZE);
+}
+
+// Oldest non-empty sector other than the head, SIZE_MAX if there is none
+static size_t oldest_sector(void)
+{
+    for (size_t i = 1; i < s_sector_count; i++) {
+        size_t sector = (s_head_sector + i) % s_sector_count;
+        if (s_sector_seq[sector] != OWL_SCANLOG_SEQ_NONE) {
+            return sector;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Rebuilds the sequence index and finds the write position after a reboot
+static void recover(void)
+{
+    owl_scanlog_record_t page[RECORDS_PER_PAGE];
+    bool found = false;
+
+    for (size_t sector = 0; sector < s_sector_count; sector++) {
+        esp_partition_read(s_partition, sector * SECTOR_SIZE, page, RECORD_SIZE);
+        s_sector_seq[sector] = OWL_SCANLOG_SEQ_NONE;
+
+        if (record_valid(&page[0])) {
+            s_sector_seq[sector] = page[0].seq;
+            if (!found || page[0].seq > s_sector_seq[s_head_sector]) {
+                s_head_sector = sector;
+                found = true;
+            }
+        } else if (!record_erased(&page[0])) {
+            ESP_LOGW(TAG, "Erasing corrupted sector %zu", sector);
+            sector_erase(sector);
+        }
+    }
+
+    if (!found) {
+        return;
+    }
+
+    // Find the end of the head sector. A page torn by a power cut is left
+    // behind, writing resumes at the next page boundary.
+    s_next_seq = s_sector_seq[s_head_sector];
+    s_head_offset = 0;
+    for (size_t offset = 0; offset < SECTOR_SIZE; offset += PAGE_SIZE) {
+        esp_partition_read(s_partition,
+                           s_head_sector * SECTOR_SIZE + offset,
+                           page,
+                           PAGE_SIZE);
+
+        for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
+            if (record_valid(&page[i])) {
+                s_next_seq = page[i].seq + 1;
+                s_head_offset = offset + (i + 1) * RECORD_SIZE;
+            } else if (!record_erased(&page[i])) {
+                ESP_LOGW(TAG, "Skipping torn page at sector %zu", s_head_sector);
+                s_head_offset = offset + PAGE_SIZE;
+            }
+        }
+    }
+}
+
+// Erases the oldest sectors beyond the retention limit, so that the writer
+// finds erased sectors ahead of it. The head counts as used before its first
+// record is flushed.
+static void compact(void)
+{
+    size_t used = 0;
+    for (size_t sector = 0; sector < s_sector_count; sector++) {
+        used += sector == s_head_sector
+             || s_sector_seq[sector] != OWL_SCANLOG_SEQ_NONE;
+    }
+
+    while (used > s_retained_sectors) {
+        size_t sector = oldest_sector();
+        if (sector == SIZE_MAX) {
+            break;
+        }
+        ESP_LOGI(TAG,
+                 "Compacting sector %zu (seq %" PRIu32 ")",
+                 sector,
+                 s_sector_seq[sector]);
+        sector_erase(sector);
+        used--;
+    }
+}
+
+// Makes sure the head sector has room, moving on to the next one (and
+// erasing it if the ring is full) when it doesn't. Every move reclaims the
+// sectors beyond the retention limit, whether or not the writer ever idles.
+static void make_room(void)
+{
+    if (s_head_offset < SECTOR_SIZE) {
+        return;
+    }
+
+    size_t next = (s_head_sector + 1) % s_sector_count;
+    if (s_sector_seq[next] != OWL_SCANLOG_SEQ_NONE) {
+        sector_erase(next);
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_head_sector = next;
+    s_head_offset = 0;
+    xSemaphoreGive(s_lock);
+
+    compact();
+}
+
+static void flush(owl_scanlog_record_t *batch, size_t len)
+{
+    esp_err_t ret = esp_partition_write(s_partition,
+                                        s_head_sector * SECTOR_SIZE
+                                            + s_head_offset,
+                                        batch,
+                                        len * RECORD_SIZE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write batch: %s", esp_err_to_name(ret));
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_head_offset == 0) {
+        s_sector_seq[s_head_sector] = batch[0].seq;
+    }
+    s_head_offset += len * RECORD_SIZE;
+    s_flushed_seq = batch[len - 1].seq + 1;
+    xSemaphoreGive(s_lock);
+}
+
+static void owl_scanlog_task(void *arg)
+{
+    owl_scanlog_record_t batch[RECORDS_PER_PAGE];
+    size_t batch_len = 0;
+    size_t batch_capacity = 0;
+    owl_scanlog_record_t record;
+
+    while (1) {
+        TickType_t timeout = batch_len ? pdMS_TO_TICKS(FLUSH_INTERVAL_MS)
+                                       : portMAX_DELAY;
+        if (!xQueueReceive(s_queue, &record, timeout)) {
+            // Idle: flush the partial batch
+            flush(batch, batch_len);
+            batch_len = 0;
+            continue;
+        }
+
+        if (batch_len == 0) {
+            make_room();
+            // Batches never cross a page boundary
+            batch_capacity = (PAGE_SIZE - s_head_offset % PAGE_SIZE)
+                           / RECORD_SIZE;
+        }
+
+        record.crc = record_crc(&record);
+        batch[batch_len++] = record;
+
+        if (batch_len == batch_capacity) {
+            flush(batch, batch_len);
+            batch_len = 0;
+        }
+    }
+}
+
+esp_err_t owl_scanlog_init(void)
+{
+    s_partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, PARTITION_LABEL);
+    if (!s_partition) {
+        ESP_LOGE(TAG, "No %s partition, scan log disabled", PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    s_sector_count = s_partition->size / SECTOR_SIZE;
+    if (s_sector_count > MAX_SECTORS) {
+        s_sector_count = MAX_SECTORS;
+    }
+    s_retained_sectors
+        = (RETENTION + RECORDS_PER_SECTOR - 1) / RECORDS_PER_SECTOR + 1;
+    if (s_retained_sectors > s_sector_count - 1) {
+        s_retained_sectors = s_sector_count - 1;
+    }
+
+    s_lock = OWL_MUTEX_CREATE(index_lock);
+    recover();
+    s_flushed_seq = s_next_seq;
+
+    s_queue = OWL_QUEUE_CREATE(writer_queue);
+    OWL_TASK_CREATE(writer_task,
+                    0,
+                    owl_scanlog_task,
+                    "owl_scanlog_task",
+                    NULL,
+                    WRITER_PRIORITY,
+                    tskNO_AFFINITY);
+
+    ESP_LOGI(TAG,
+             "Initialized scan log (%zu sectors, next seq %" PRIu32 ")",
+             s_sector_count,
+             s_next_seq);
+    return ESP_OK;
+}
+
+void owl_scanlog_append(const owl_scan_record_t *scan,
+                        owl_scanlog_record_t *records)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    for (size_t i = 0; i < scan->count; i++) {
+        owl_scanlog_record_t record = {
+            .seq = OWL_SCANLOG_SEQ_NONE,
+            .id = scan->id,
+            .timestamp_us = (int64_t) now.tv_sec * 1000000 + now.tv_usec,
+            .rom = scan->addresses[i],
+            .reserved = UINT32_MAX,
+        };
+
+        if (s_queue) {
+            record.seq = s_next_seq;
+            if (xQueueSend(s_queue, &record, 0) == pdTRUE) {
+                s_next_seq++;
+            } else {
+                record.seq = OWL_SCANLOG_SEQ_NONE;
+                s_dropped++;
+                ESP_LOGW(
+                    TAG, "Writer queue full (%" PRIu32 " dropped)", s_dropped);
+            }
+        }
+
+        if (records) {
+            records[i] = record;
+        }
+    }
+}
+
+void owl_scanlog_range(uint32_t *first_seq, uint32_t *next_seq)
+{
+    *first_seq = *next_seq = 0;
+    if (!s_partition) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    size_t oldest = oldest_sector();
+    if (oldest == SIZE_MAX) {
+        oldest = s_head_sector;
+    }
+    if (s_sector_seq[oldest] != OWL_SCANLOG_SEQ_NONE) {
+        *first_seq = s_sector_seq[oldest];
+    }
+    *next_seq = s_flushed_seq;
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t owl_scanlog_read(uint32_t seq, owl_scanlog_record_t *record)
+{
+    if (!s_partition) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The sector holding `seq` is the one with the greatest first seq <= seq
+    size_t sector = SIZE_MAX;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (size_t i = 0; i < s_sector_count; i++) {
+        uint32_t first = s_sector_seq[i];
+        if (first != OWL_SCANLOG_SEQ_NONE && first <= seq
+            && (sector == SIZE_MAX || first > s_sector_seq[sector])) {
+            sector = i;
+        }
+    }
+    uint32_t first = sector != SIZE_MAX ? s_sector_seq[sector] : 0;
+    xSemaphoreGive(s_lock);
+
+    if (sector == SIZE_MAX || seq - first >= RECORDS_PER_SECTOR) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_partition_read(s_partition,
+                       sector * SECTOR_SIZE + (seq - first) * RECORD_SIZE,
+                       record,
+                       RECORD_SIZE);
+    if (record_valid(record) && record->seq == seq) {
+        return ESP_OK;
+    }
+
+    // Records following a torn page are shifted, fall back to a linear scan
+    for (size_t offset = 0; offset < SECTOR_SIZE; offset += RECORD_SIZE) {
+        esp_partition_read(
+            s_partition, sector * SECTOR_SIZE + offset, record, RECORD_SIZE);
+        if (record_valid(record) && record->seq == seq) {
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
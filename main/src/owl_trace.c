@@ -0,0 +1,127 @@
+#include "owl_trace.h"
+
+#ifdef CONFIG_OWL_TRACE
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <string.h>
+
+static const char *TAG = "owl_trace";
+
+#define RING_LEN CONFIG_OWL_TRACE_RING_LEN
+
+_Static_assert((RING_LEN & (RING_LEN - 1)) == 0,
+               "Trace ring length must be a power of two");
+
+// Each core only ever writes its own ring and histograms, the lock just
+// keeps readers on the other core from seeing torn spans
+typedef struct {
+    portMUX_TYPE lock;
+    uint32_t head;
+    owl_trace_span_t ring[RING_LEN];
+    uint32_t histogram[OWL_TRACE_STAGE_COUNT][OWL_TRACE_BUCKETS];
+} trace_core_t;
+
+static trace_core_t s_cores[portNUM_PROCESSORS];
+
+static volatile uint16_t s_trace_id = 0;
+static volatile int64_t s_origin_us = 0;
+
+static const char *const stage_names[OWL_TRACE_STAGE_COUNT] = {
+    [OWL_TRACE_INPUT] = "input",
+    [OWL_TRACE_LED] = "led",
+    [OWL_TRACE_SEARCH] = "search",
+    [OWL_TRACE_MEMORY] = "memory",
+    [OWL_TRACE_FORMAT] = "format",
+    [OWL_TRACE_DISPLAY] = "display",
+    [OWL_TRACE_WS_SEND] = "ws_send",
+    [OWL_TRACE_TOTAL] = "total",
+};
+
+void owl_trace_init(void)
+{
+    for (size_t i = 0; i < portNUM_PROCESSORS; i++) {
+        s_cores[i].lock = (portMUX_TYPE) portMUX_INITIALIZER_UNLOCKED;
+    }
+    ESP_LOGI(TAG, "Tracing enabled (%d spans per core)", RING_LEN);
+}
+
+void owl_trace_begin(void)
+{
+    s_trace_id++;
+}
+
+void owl_trace_set_origin(int64_t origin_us)
+{
+    s_origin_us = origin_us;
+}
+
+int64_t owl_trace_origin(void)
+{
+    return s_origin_us;
+}
+
+static inline size_t bucket_of(uint32_t duration_us)
+{
+    size_t bucket = duration_us ? 32 - __builtin_clz(duration_us) : 0;
+    return bucket < OWL_TRACE_BUCKETS ? bucket : OWL_TRACE_BUCKETS - 1;
+}
+
+void owl_trace_record(owl_trace_stage_t stage, int64_t start_us, int64_t end_us)
+{
+    uint32_t duration_us = end_us - start_us;
+    size_t bucket = bucket_of(duration_us);
+
+    trace_core_t *core = &s_cores[xPortGetCoreID()];
+    portENTER_CRITICAL_SAFE(&core->lock);
+    owl_trace_span_t *span = &core->ring[core->head++ & (RING_LEN - 1)];
+    span->start_us = start_us;
+    span->duration_us = duration_us;
+    span->trace_id = s_trace_id;
+    span->stage = stage;
+    span->core = core - s_cores;
+    core->histogram[stage][bucket]++;
+    portEXIT_CRITICAL_SAFE(&core->lock);
+}
+
+const char *owl_trace_stage_name(owl_trace_stage_t stage)
+{
+    return stage < OWL_TRACE_STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+size_t owl_trace_snapshot(owl_trace_span_t *buff, size_t max_spans)
+{
+    size_t count = 0;
+
+    for (size_t c = 0; c < portNUM_PROCESSORS; c++) {
+        trace_core_t *core = &s_cores[c];
+
+        portENTER_CRITICAL(&core->lock);
+        uint32_t head = core->head;
+        uint32_t len = head < RING_LEN ? head : RING_LEN;
+        for (uint32_t i = head - len; i != head && count < max_spans; i++) {
+            buff[count++] = core->ring[i & (RING_LEN - 1)];
+        }
+        portEXIT_CRITICAL(&core->lock);
+    }
+    return count;
+}
+
+void owl_trace_histogram(owl_trace_stage_t stage,
+                         uint32_t buckets[OWL_TRACE_BUCKETS])
+{
+    memset(buckets, 0, OWL_TRACE_BUCKETS * sizeof(uint32_t));
+
+    for (size_t c = 0; c < portNUM_PROCESSORS; c++) {
+        trace_core_t *core = &s_cores[c];
+
+        portENTER_CRITICAL(&core->lock);
+        for (size_t i = 0; i < OWL_TRACE_BUCKETS; i++) {
+            buckets[i] += core->histogram[stage][i];
+        }
+        portEXIT_CRITICAL(&core->lock);
+    }
+}
+
+#endif
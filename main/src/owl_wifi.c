@@ -5,10 +5,13 @@
 #include "esp_netif.h"
 #include "esp_wifi.h"
 
+#include "owl_mem.h"
+#include "owl_metrics.h"
 #include "owl_wifi.h"
 
 #include "nvs_flash.h"
 #include "owl_display.h"
+#include "owl_log.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +27,20 @@ static const char *TAG = "owl_wifi";
 #define SOFTAP_CH CONFIG_OWL_SOFTAP_CH
 #define SOFTAP_MAX_CONN CONFIG_OWL_SOFTAP_MAX_CONN
 
+static int32_t read_rssi(void)
+{
+    int rssi;
+    return esp_wifi_sta_get_rssi(&rssi) == ESP_OK ? rssi : 0;
+}
+
+OWL_METRIC_COUNTER_DEFINE(reconnects_metric,
+                          "owl_wifi_reconnects_total",
+                          "STA reconnection attempts");
+OWL_METRIC_GAUGE_DEFINE(rssi_metric,
+                        "owl_wifi_rssi_dbm",
+                        "RSSI of the STA connection, 0 when disconnected",
+                        read_rssi);
+
 static void wifi_event_handler(void *arg,
                                esp_event_base_t event_base,
                                int32_t event_id,
@@ -35,14 +52,15 @@ static void wifi_event_handler(void *arg,
 
     if (event_base == WIFI_EVENT
         && event_id == WIFI_EVENT_STA_START) { // STA events
-        ESP_LOGI(TAG, "Station started - connecting to WiFi");
+        OWL_LOGI(TAG, "Station started - connecting to WiFi");
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT
                && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         if (s_retry_num < 3) {
             esp_wifi_connect();
             s_retry_num++;
-            ESP_LOGI(TAG,
+            owl_metric_inc(&reconnects_metric);
+            OWL_LOGI(TAG,
                      "Connection to %s: attempt %zu",
                      (const char *) conf.sta.ssid,
                      s_retry_num);
@@ -53,7 +71,7 @@ static void wifi_event_handler(void *arg,
                         owl_rgb(OWL_COLOR_YELLOW),
                         -1);
         } else {
-            ESP_LOGI(
+            OWL_LOGI(
                 TAG, "Failed to connect to %s: ", (const char *) conf.sta.ssid);
             owl_display((const char *) conf.sta.ssid,
                         "Conn failed",
@@ -62,12 +80,12 @@ static void wifi_event_handler(void *arg,
         }
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
-        ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
+        OWL_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
     } else if (event_id == WIFI_EVENT_AP_STACONNECTED) { // AP events
         wifi_event_ap_staconnected_t *event
             = (wifi_event_ap_staconnected_t *) event_data;
-        ESP_LOGI(TAG,
+        OWL_LOGI(TAG,
                  "Station " MACSTR " joined AP, AID=%d",
                  MAC2STR(event->mac),
                  event->aid);
@@ -79,7 +97,7 @@ static void wifi_event_handler(void *arg,
     } else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) {
         wifi_event_ap_stadisconnected_t *event
             = (wifi_event_ap_stadisconnected_t *) event_data;
-        ESP_LOGI(TAG,
+        OWL_LOGI(TAG,
                  "Station " MACSTR " left AP, AID=%d, reason=%d",
                  MAC2STR(event->mac),
                  event->aid,
@@ -97,6 +115,10 @@ void owl_wifi_init(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    owl_metrics_register(&reconnects_metric);
+    owl_metrics_register(&rssi_metric);
+
+    size_t mem = owl_mem_track_begin();
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
@@ -108,6 +130,7 @@ void owl_wifi_init(void)
 
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL, NULL));
+    owl_mem_track_end(OWL_MEM_WIFI, mem);
 
     uint8_t mac_sta[6];
     uint8_t mac_ap[6];
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+"""Decodes a deferred log dump (`/console.bin`, CONFIG_OWL_LOG_DEFERRED).
+
+Records only carry pointers to their tag and format strings, which are
+resolved against the firmware ELF the dump was taken from:
+
+    curl -o console.bin http://<OWL IP>/console.bin
+    tools/owl_log_decode.py build/owl.elf console.bin
+
+Requires pyelftools (`pip install pyelftools`, bundled with ESP-IDF).
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+DUMP_MAGIC = 0x4C4C574F  # "OWLL"
+DUMP_HEADER = struct.Struct("<II")  # magic, lost
+RECORD_HEADER = struct.Struct("<HBBIII")  # len, level, padding, ms, tag, format
+LEVELS = "NEWIDV"
+
+# Same grammar as parse_spec() in main/src/owl_log.c
+SPEC = re.compile(
+    r"%(?P<flags>[-+ #0]*)(?P<width>\*|\d*)(?:\.(?P<precision>\*|\d*))?"
+    r"(?P<length>[hlzjtL]*)(?P<conversion>.?)"
+)
+
+
+class Strings:
+    """Reads null-terminated strings from the loadable sections of an ELF."""
+
+    def __init__(self, path):
+        self.sections = []
+        with open(path, "rb") as f:
+            for section in ELFFile(f).iter_sections():
+                if section["sh_addr"] and section["sh_type"] == "SHT_PROGBITS":
+                    self.sections.append((section["sh_addr"], section.data()))
+
+    def get(self, address):
+        for start, data in self.sections:
+            if start <= address < start + len(data):
+                end = data.index(b"\0", address - start)
+                return data[address - start : end].decode("utf-8", "replace")
+        return f"<0x{address:08x}>"
+
+
+def take(fmt, args, pos):
+    value = struct.unpack_from(fmt, args, pos)[0]
+    return value, pos + struct.calcsize(fmt)
+
+
+def format_record(fmt, args):
+    out = []
+    pos = 0
+    last = 0
+    try:
+        for m in SPEC.finditer(fmt):
+            out.append(fmt[last : m.start()])
+            last = m.end()
+            conversion = m["conversion"]
+            if conversion == "%":
+                out.append("%")
+                continue
+
+            stars = []
+            for field in ("width", "precision"):
+                if m[field] == "*":
+                    star, pos = take("<i", args, pos)
+                    stars.append(star)
+
+            length = m["length"]
+            if conversion in "diuxXoc":
+                wide = "ll" in length or "j" in length
+                signed = conversion in "di"
+                value, pos = take(
+                    ("<q" if signed else "<Q") if wide else ("<i" if signed else "<I"),
+                    args,
+                    pos,
+                )
+                if conversion == "c":
+                    value = chr(value & 0xFF)
+            elif conversion in "fFeEgGaA":
+                value, pos = take("<d", args, pos)
+            elif conversion == "p":
+                value, pos = take("<I", args, pos)
+                conversion = "x"
+                out.append("0x")
+            elif conversion == "s":
+                n = args[pos]
+                value = args[pos + 1 : pos + 1 + n].decode("utf-8", "replace")
+                if pos + 1 + n > len(args):
+                    raise IndexError
+                pos += 1 + n
+            else:
+                continue
+
+            width = str(stars.pop(0)) if m["width"] == "*" else m["width"]
+            precision = m["precision"]
+            if precision == "*":
+                precision = str(stars.pop(0))
+            spec = "%" + m["flags"] + width
+            if precision is not None:
+                spec += "." + precision
+            out.append((spec + conversion) % value)
+    except (IndexError, struct.error):
+        out.append("...")
+        return "".join(out)
+
+    out.append(fmt[last:])
+    return "".join(out)
+
+
+def decode(dump, strings):
+    magic, lost = DUMP_HEADER.unpack_from(dump, 0)
+    if magic != DUMP_MAGIC:
+        sys.exit("Not a deferred log dump")
+    if lost:
+        print(f"# {lost} records overwritten before being formatted")
+
+    pos = DUMP_HEADER.size
+    while pos + RECORD_HEADER.size <= len(dump):
+        length, level, padding, ms, tag, fmt = RECORD_HEADER.unpack_from(dump, pos)
+        if length < RECORD_HEADER.size or pos + length > len(dump):
+            break
+        args = dump[pos + RECORD_HEADER.size : pos + length - padding]
+        message = format_record(strings.get(fmt), args)
+        level = LEVELS[level] if level < len(LEVELS) else "?"
+        print(f"{level} ({ms}) {strings.get(tag)}: {message}")
+        pos += length
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="firmware ELF (build/owl.elf)")
+    parser.add_argument("dump", help="dump fetched from /console.bin")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        decode(f.read(), Strings(args.elf))
+
+
+if __name__ == "__main__":
+    main()
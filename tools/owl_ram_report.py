@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Reports the static RAM of each OWL subsystem from the link map.
+
+With CONFIG_OWL_STATIC_ALLOC every task stack, queue and pool of the app is
+reserved at link time, so the map accounts for all of it. Runs after every
+build in that mode, and fails it when the total exceeds the budget:
+
+    tools/owl_ram_report.py build/owl.map --budget 65536 [-v]
+"""
+
+import argparse
+import re
+import sys
+from collections import defaultdict
+
+# Input sections placed in internal RAM, by kind
+KINDS = (
+    ("data", re.compile(r"^\.(s?data|dram1)\b")),
+    ("bss", re.compile(r"^(\.s?bss\b|COMMON$)")),
+    ("iram", re.compile(r"^\.iram1?\b")),
+)
+
+# " .bss.name  0x3fc8e000  0x1000 esp-idf/main/libmain.a(owl_led.c.obj)", the
+# section name may also stand alone on the previous line when it is long
+ENTRY = re.compile(
+    r"^ (?P<section>\S+)?\s+0x(?P<address>[0-9a-f]+)\s+0x(?P<size>[0-9a-f]+)"
+    r"\s+(?P<file>\S+)$"
+)
+SECTION_ONLY = re.compile(r"^ (?P<section>[.\w]\S*)$")
+MAIN_OBJECT = re.compile(r"libmain\.a\((?P<name>[\w.]+?)\.c(pp)?\.obj\)$")
+
+
+def kind_of(section):
+    for kind, pattern in KINDS:
+        if pattern.match(section):
+            return kind
+    return None
+
+
+def subsystem_of(name):
+    return name[len("owl_") :] if name.startswith("owl_") else name
+
+
+def parse(path):
+    """Returns {subsystem: {kind: size}} and [(subsystem, section, size)]."""
+    usage = defaultdict(lambda: defaultdict(int))
+    sections = []
+    pending = None
+    in_memory_map = False
+
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if not in_memory_map:
+                # Skips the discarded input sections listed first
+                in_memory_map = line.startswith("Linker script and memory map")
+                continue
+
+            m = SECTION_ONLY.match(line)
+            if m:
+                pending = m["section"]
+                continue
+
+            m = ENTRY.match(line)
+            if not m:
+                pending = None
+                continue
+            section = m["section"] or pending
+            pending = None
+
+            obj = MAIN_OBJECT.search(m["file"])
+            size = int(m["size"], 16)
+            if not obj or not section or not size or not int(m["address"], 16):
+                continue
+            kind = kind_of(section)
+            if kind:
+                subsystem = subsystem_of(obj["name"])
+                usage[subsystem][kind] += size
+                sections.append((subsystem, section, size))
+
+    if not in_memory_map:
+        sys.exit(f"{path}: not a GNU ld map file")
+    return usage, sections
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("map", help="link map (build/owl.map)")
+    parser.add_argument(
+        "--budget", type=int, default=0, help="fail above this many bytes"
+    )
+    parser.add_argument(
+        "-v", "--verbose", action="store_true", help="list every section"
+    )
+    args = parser.parse_args()
+
+    usage, sections = parse(args.map)
+    kinds = [kind for kind, _ in KINDS]
+
+    print("OWL static RAM (bytes)")
+    header = "".join(f"{kind:>8}" for kind in kinds)
+    print(f"{'subsystem':<16}{header}{'total':>8}")
+    totals = defaultdict(int)
+    for subsystem in sorted(usage, key=lambda s: -sum(usage[s].values())):
+        row = usage[subsystem]
+        for kind in kinds:
+            totals[kind] += row[kind]
+        columns = "".join(f"{row[kind]:>8}" for kind in kinds)
+        print(f"{subsystem:<16}{columns}{sum(row.values()):>8}")
+    total = sum(totals.values())
+    columns = "".join(f"{totals[kind]:>8}" for kind in kinds)
+    print(f"{'total':<16}{columns}{total:>8}")
+
+    if args.verbose:
+        print()
+        for subsystem, section, size in sorted(sections, key=lambda s: -s[2]):
+            print(f"{size:>8}  {subsystem:<16}{section}")
+
+    if args.budget and total > args.budget:
+        sys.exit(
+            f"error: static RAM ({total} bytes) exceeds "
+            f"CONFIG_OWL_STATIC_RAM_BUDGET ({args.budget} bytes)"
+        )
+    if args.budget:
+        print(f"Budget {args.budget}: {args.budget - total} bytes left")
+
+
+if __name__ == "__main__":
+    main()